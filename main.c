@@ -2,906 +2,655 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <ctype.h>
-
-// Token types and scanner code
-typedef enum {
-  TOKEN_VAR,
-  TOKEN_SEMICOLON,
-  TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-  TOKEN_PLUS, TOKEN_MINUS, TOKEN_STAR, TOKEN_SLASH,
-  TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
-  TOKEN_BANG, TOKEN_BANG_EQUAL,
-  TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
-  TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE, TOKEN_FOR, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
-  TOKEN_POWER, TOKEN_EOF, TOKEN_INDENT, TOKEN_DEDENT, TOKEN_NEWLINE,
-  TOKEN_LET, TOKEN_FUNC, TOKEN_RETURN, TOKEN_WHILE, TOKEN_TRUE,
-  TOKEN_LESS, TOKEN_LESS_EQUAL, TOKEN_GREATER, TOKEN_GREATER_EQUAL,
-  TOKEN_COMMA, TOKEN_DOT, TOKEN_COLON,
-  TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
-} TokenType;
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
 
-typedef struct {
-    TokenType type;
-    const char* start;
-    int length;
-    int line;
-    double literal;
-} Token;
-
-typedef struct {
-    const char* start;
-    const char* current;
-    int line;
-} Scanner;
-
-typedef enum {
-    EXPR_BINARY,
-    EXPR_UNARY,
-    EXPR_LITERAL,
-    EXPR_GROUPING,
-    EXPR_VARIABLE,
-    EXPR_ASSIGN,
-    EXPR_LOGICAL,
-    EXPR_CALL
-} ExprType;
-
-typedef struct Expr {
-    ExprType type;
-    Token token;
-    struct Expr* left;
-    struct Expr* right;
-    struct Expr* expr;
-    struct Expr* callee;
-    double value;
-    const char* name;
-    int arg_count;
-    struct Expr** args;
-    struct {
-        int depth;
-        bool is_captured;
-    } variable;
-} Expr;
+#include "splang.h"
 
-typedef struct {
-    Token name;
-    Expr* initializer;
-} VarDecl;
-
-typedef enum {
-    STMT_EXPR,
-    STMT_VAR,
-    STMT_BLOCK,
-    STMT_IF,
-    STMT_WHILE,
-    STMT_FUNC,
-    STMT_RETURN
-} StmtType;
-
-typedef struct Stmt {
-    StmtType type;
-    Expr* expr;
-    VarDecl var_decl;
-    struct Stmt** stmts;
-    int stmt_count;
-    struct Stmt* then_branch;
-    struct Stmt* else_branch;
-    Token name;
-    struct Stmt** body;
-    int param_count;
-    Token* params;
-} Stmt;
-
-typedef struct {
-    Token current;
-    Token previous;
-    bool had_error;
-    bool panic_mode;
-} Parser;
+// Symbol daemon
 
 typedef struct {
-    const char* name;
-    int depth;
-    bool is_const;
-} Variable;
+    char* path;
+    char* text;
+    struct timespec modified;
+    off_t size;
+    CompilerContext context;
+    SymbolIndex index;
+} IndexedFile;
 
 typedef struct {
-    Variable* variables;
+    IndexedFile** files;
     int capacity;
     int count;
-} VariableArray;
-
-typedef struct {
-    VariableArray variables;
-    struct Scope* enclosing;
-} Scope;
-
-typedef struct {
-    Scope* current;
-} Analyzer;
-
-// Function declarations
-
-Stmt* parse(Scanner* scanner);
-void resolve(Stmt* stmt, Analyzer* analyzer);
-
-// Scanner functions
-
-void init_scanner(Scanner* scanner, const char* source) {
-    scanner->start = source;
-    scanner->current = source;
-    scanner->line = 1;
-}
-
-bool is_at_end(Scanner* scanner) {
-    return *scanner->current == '\0';
-}
-
-char advance(Scanner* scanner) {
-    scanner->current++;
-    return scanner->current[-1];
-}
-
-bool match(Scanner* scanner, char expected) {
-    if (is_at_end(scanner)) return false;
-    if (*scanner->current != expected) return false;
-    scanner->current++;
+} Workspace;
+
+const char* symbol_kind_names[] = {
+    [SYMBOL_VARIABLE] = "variable",
+    [SYMBOL_FUNCTION] = "function",
+    [SYMBOL_PARAMETER] = "parameter",
+};
+
+char* read_file(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char* buffer = malloc(size + 1);
+    size_t bytes_read = fread(buffer, 1, size, file);
+    buffer[bytes_read] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+// Recompiles a file only when its modification time or size has changed
+// since it was last indexed; otherwise queries are answered from the
+// existing index. The time is compared to the nanosecond, so two saves
+// within the same second are still told apart.
+bool refresh_file(IndexedFile* file) {
+    struct stat info;
+    if (stat(file->path, &info) != 0) return false;
+    if (file->text != NULL && info.st_mtim.tv_sec == file->modified.tv_sec &&
+        info.st_mtim.tv_nsec == file->modified.tv_nsec && info.st_size == file->size) return true;
+
+    char* text = read_file(file->path);
+    if (text == NULL) return false;
+
+    free(file->text);
+    file->text = text;
+    file->modified = info.st_mtim;
+    file->size = info.st_size;
+
+    reset_symbol_index(&file->index);
+    file->context.analyzer.index = &file->index;
+    compile(&file->context, file->text);
+    finish_symbol_index(&file->index);
     return true;
 }
 
-Token make_token(Scanner* scanner, TokenType type) {
-    Token token;
-    token.type = type;
-    token.start = scanner->start;
-    token.length = (int)(scanner->current - scanner->start);
-    token.line = scanner->line;
-    return token;
-}
-
-Token error_token(Scanner* scanner, const char* message) {
-    Token token;
-    token.type = TOKEN_EOF;
-    token.start = message;
-    token.length = (int)strlen(message);
-    token.line = scanner->line;
-    return token;
-}
-
-void skip_whitespace(Scanner* scanner) {
-    for (;;) {
-        char c = *scanner->current;
-        switch (c) {
-            case ' ':
-            case '\r':
-            case '\t':
-                advance(scanner);
-                break;
-            case '\n':
-                scanner->line++;
-                advance(scanner);
-                break;
-            case '#':
-                while (*scanner->current != '\n' && !is_at_end(scanner)) advance(scanner);
-                break;
-            default:
-                return;
-        }
-    }
-}
-
-Token string(Scanner* scanner) {
-    while (*scanner->current != '"' && !is_at_end(scanner)) {
-        if (*scanner->current == '\n') scanner->line++;
-        advance(scanner);
-    }
-
-    if (is_at_end(scanner)) return error_token(scanner, "Unterminated string.");
-
-    advance(scanner);
-    return make_token(scanner, TOKEN_STRING);
-}
-
-bool is_digit(char c) {
-    return c >= '0' && c <= '9';
-}
-
-Token number(Scanner* scanner) {
-    while (is_digit(*scanner->current)) advance(scanner);
-
-    if (*scanner->current == '.' && is_digit(scanner->current[1])) {
-        advance(scanner);
-        while (is_digit(*scanner->current)) advance(scanner);
-    }
-
-    return make_token(scanner, TOKEN_NUMBER);
-}
-
-bool is_alpha(char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
-}
-
-TokenType identifier_type(Scanner* scanner, int start, int length) {
-    switch (scanner->start[start]) {
-        case 'a': return check_keyword(scanner, start, length, "nd", TOKEN_AND);
-        case 'c':
-            if (scanner->current - scanner->start > start + 1) {
-                switch (scanner->start[start + 1]) {
-                    case 'l': return check_keyword(scanner, start, length, "ass", TOKEN_CLASS);
-                    case 'o': return check_keyword(scanner, start, length, "nst", TOKEN_VAR);
-                }
-            }
-            break;
-        case 'e': return check_keyword(scanner, start, length, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner->current - scanner->start > start + 1) {
-                switch (scanner->start[start + 1]) {
-                    case 'a': return check_keyword(scanner, start, length, "lse", TOKEN_FALSE);
-                    case 'o': return check_keyword(scanner, start, length, "r", TOKEN_FOR);
-                    case 'u': return check_keyword(scanner, start, length, "nc", TOKEN_FUNC);
-                }
-            }
-            break;
-        case 'i': return check_keyword(scanner, start, length, "f", TOKEN_IF);
-        case 'n': return check_keyword(scanner, start, length, "il", TOKEN_NIL);
-        case 'o': return check_keyword(scanner, start, length, "r", TOKEN_OR);
-        case 'r': return check_keyword(scanner, start, length, "eturn", TOKEN_RETURN);
-        case 't': return check_keyword(scanner, start, length, "rue", TOKEN_TRUE);
-        case 'w': return check_keyword(scanner, 1, 4, "hile", TOKEN_WHILE);
-    }
-
-    return TOKEN_IDENTIFIER;
-}
-
-Token identifier(Scanner* scanner) {
-    while (is_alpha(*scanner->current) || is_digit(*scanner->current)) advance(scanner);
-    return make_token(scanner, identifier_type(scanner));
-}
-
-Token scan_token(Scanner* scanner) {
-    skip_whitespace(scanner);
-
-    scanner->start = scanner->current;
-
-    if (is_at_end(scanner)) return make_token(scanner, TOKEN_EOF);
-
-    char c = advance(scanner);
-
-    if (is_alpha(c)) return identifier(scanner);
-    if (is_digit(c)) return number(scanner);
-
-    switch (c) {
-        case '(': return make_token(scanner, TOKEN_LEFT_PAREN);
-        case ')': return make_token(scanner, TOKEN_RIGHT_PAREN);
-        case '{': return make_token(scanner, TOKEN_LEFT_BRACE);
-        case '}': return make_token(scanner, TOKEN_RIGHT_BRACE);
-        case ';': return make_token(scanner, TOKEN_SEMICOLON);
-        case ',': return make_token(scanner, TOKEN_COMMA);
-        case '.': return make_token(scanner, TOKEN_DOT);
-        case '-': return make_token(scanner, TOKEN_MINUS);
-        case '+': return make_token(scanner, TOKEN_PLUS);
-        case '/': return make_token(scanner, TOKEN_SLASH);
-        case '*':
-            return make_token(scanner, match(scanner, '*') ? TOKEN_POWER : TOKEN_STAR);
-        case '!':
-            return make_token(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-        case '=':
-            return make_token(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-        case '<':
-            return make_token(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-        case '>':
-            return make_token(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-        case '"': return string(scanner);
+IndexedFile* open_file(Workspace* workspace, const char* path) {
+    for (int i = 0; i < workspace->count; i++) {
+        IndexedFile* file = workspace->files[i];
+        if (strcmp(file->path, path) == 0) return refresh_file(file) ? file : NULL;
     }
 
-    return error_token(scanner, "Unexpected character.");
-}
-
-// Parser functions
-
-Expr* parse_expression(Parser* parser) {
-    return parse_assignment(parser);
-}
-
-Expr* parse_equality(Parser* parser) {
-    Expr* expr = parse_comparison(parser);
-
-    while (parser->current.type == TOKEN_EQUAL_EQUAL || parser->current.type == TOKEN_BANG_EQUAL) {
-        Token op = parser->current;
-        advance(parser);
-        Expr* right = parse_comparison(parser);
-        expr = binary_expr(expr, op, right);
+    if (workspace->capacity < workspace->count + 1) {
+        int new_capacity = workspace->capacity < 8 ? 8 : workspace->capacity * 2;
+        workspace->files = realloc(workspace->files, new_capacity * sizeof(IndexedFile*));
+        workspace->capacity = new_capacity;
     }
 
-    return expr;
+    IndexedFile* file = malloc(sizeof(IndexedFile));
+    file->path = strdup(path);
+    file->text = NULL;
+    file->modified.tv_sec = 0;
+    file->modified.tv_nsec = 0;
+    file->size = 0;
+    init_compiler_context(&file->context);
+    init_symbol_index(&file->index);
+    workspace->files[workspace->count++] = file;
+    return refresh_file(file) ? file : NULL;
 }
 
-Expr* parse_comparison(Parser* parser) {
-    Expr* expr = parse_term(parser);
-
-    while (parser->current.type == TOKEN_LESS || parser->current.type == TOKEN_LESS_EQUAL ||
-           parser->current.type == TOKEN_GREATER || parser->current.type == TOKEN_GREATER_EQUAL) {
-        Token op = parser->current;
-        advance(parser);
-        Expr* right = parse_term(parser);
-        expr = binary_expr(expr, op, right);
+void free_workspace(Workspace* workspace) {
+    for (int i = 0; i < workspace->count; i++) {
+        IndexedFile* file = workspace->files[i];
+        free_symbol_index(&file->index);
+        free_compiler_context(&file->context);
+        free(file->text);
+        free(file->path);
+        free(file);
     }
-
-    return expr;
+    free(workspace->files);
 }
 
-Expr* parse_term(Parser* parser) {
-    Expr* expr = parse_factor(parser);
-
-    while (parser->current.type == TOKEN_PLUS || parser->current.type == TOKEN_MINUS) {
-        Token op = parser->current;
-        advance(parser);
-        Expr* right = parse_factor(parser);
-        expr = binary_expr(expr, op, right);
-    }
-
-    return expr;
-}
-
-Expr* parse_factor(Parser* parser) {
-    Expr* expr = parse_unary(parser);
-
-    while (parser->current.type == TOKEN_STAR || parser->current.type == TOKEN_SLASH) {
-        Token op = parser->current;
-        advance(parser);
-        Expr* right = parse_unary(parser);
-        expr = binary_expr(expr, op, right);
-    }
-
-    return expr;
-}
-
-Expr* parse_unary(Parser* parser) {
-    if (parser->current.type == TOKEN_BANG || parser->current.type == TOKEN_MINUS) {
-        Token op = parser->current;
-        advance(parser);
-        Expr* right = parse_unary(parser);
-        return unary_expr(op, right);
-    }
-
-    return parse_call(parser);
-}
-
-Expr* parse_primary(Parser* parser) {
-    switch (parser->current.type) {
-        case TOKEN_FALSE:
-            advance(parser);
-            return literal_expr(false);
-        case TOKEN_TRUE:
-            advance(parser);
-            return literal_expr(true);
-        case TOKEN_NIL:
-            advance(parser);
-            return literal_expr(0);
-        case TOKEN_NUMBER:
-        case TOKEN_STRING:
-            return literal_expr(parser->previous.literal);
-        case TOKEN_IDENTIFIER:
-            return parse_variable(parser);
-        case TOKEN_LEFT_PAREN:
-            advance(parser);
-            Expr* expr = parse_expression(parser);
-            consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
-            return grouping_expr(expr);
-        default:
-            error_at_current(parser, "Expect expression.");
-            return NULL;
-    }
-}
-
-Expr* parse_variable(Parser* parser) {
-    consume(parser, TOKEN_IDENTIFIER, "Expect variable name.");
-    return variable_expr(parser->previous);
-}
-
-Expr* parse_assignment(Parser* parser) {
-    Expr* expr = parse_logical_or(parser);
-
-    if (parser->current.type == TOKEN_EQUAL) {
-        Token equals = parser->current;
-        advance(parser);
-        Expr* value = parse_assignment(parser);
-
-        if (expr->type == EXPR_VARIABLE) {
-            Token name = expr->token;
-            return assign_expr(name, value);
+void print_location(IndexedFile* file, int64_t offset) {
+    int line;
+    int64_t column;
+    source_location(&file->context.source, offset, &line, &column);
+    printf("%s:%d:%" PRId64 "\n", file->path, line, column);
+}
+
+// Lists the declarations visible at `offset`: everything in the global
+// scope, plus locals declared before it in the scopes enclosing it. A
+// shadowed name is listed once per declaration.
+void print_names(IndexedFile* file, int64_t offset) {
+    SymbolIndex* index = &file->index;
+    for (int i = 0; i < index->declaration_count; i++) {
+        Declaration* decl = &index->declarations[i];
+        ScopeRange* scope = &index->scopes[decl->scope];
+        if (offset < scope->start || offset >= scope->end) continue;
+        if (decl->scope != 0 && decl->offset >= offset) continue;
+        printf("%s %.*s\n", symbol_kind_names[decl->kind], decl->length, file->text + decl->offset);
+    }
+    printf("end\n");
+}
+
+// Answers one query per line of stdin, keeping every file it has seen
+// indexed between queries:
+//   def <path> <offset>    location of the declaration
+//   refs <path> <offset>   location of each reference, then "end"
+//   hover <path> <offset>  symbol kind and name
+//   names <path> <offset>  kind and name of each declaration in scope, then "end"
+// Offsets are byte offsets; a name that resolves to nothing answers "none".
+void run_daemon() {
+    Workspace workspace;
+    workspace.files = NULL;
+    workspace.capacity = 0;
+    workspace.count = 0;
+
+    char line[4096];
+    char command[16];
+    char path[4000];
+    int64_t offset;
+
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        if (sscanf(line, "%15s %3999s %" SCNd64, command, path, &offset) != 3) {
+            printf("error\n");
+            fflush(stdout);
+            continue;
         }
 
-        error_at_current(parser, "Invalid assignment target.");
-    }
-
-    return expr;
-}
-
-Expr* parse_logical_or(Parser* parser) {
-    Expr* expr = parse_logical_and(parser);
-
-    while (parser->current.type == TOKEN_OR) {
-        Token op = parser->current;
-        advance(parser);
-        Expr* right = parse_logical_and(parser);
-        expr = logical_expr(expr, op, right);
-    }
-
-    return expr;
-}
-
-Expr* parse_logical_and(Parser* parser) {
-    Expr* expr = parse_equality(parser);
-
-    while (parser->current.type == TOKEN_AND) {
-        Token op = parser->current;
-        advance(parser);
-        Expr* right = parse_equality(parser);
-        expr = logical_expr(expr, op, right);
-    }
-
-    return expr;
-}
-
-Expr* parse_call(Parser* parser) {
-    Expr* expr = parse_primary(parser);
-
-    while (true) {
-        if (parser->current.type == TOKEN_LEFT_PAREN) {
-            advance(parser);
-            expr = finish_call(parser, expr);
-        } else {
-            break;
+        IndexedFile* file = open_file(&workspace, path);
+        if (file != NULL && strcmp(command, "names") == 0) {
+            print_names(file, offset);
+            fflush(stdout);
+            continue;
         }
-    }
-
-    return expr;
-}
 
-Expr* parse_arguments(Parser* parser) {
-    Expr** args = NULL;
-    int arg_count = 0;
-
-    if (parser->current.type != TOKEN_RIGHT_PAREN) {
-        do {
-            if (arg_count >= 255) {
-                error_at_current(parser, "Can't have more than 255 arguments.");
+        int declaration = file != NULL ? find_declaration_at(&file->index, offset) : -1;
+
+        if (declaration == -1) {
+            printf("none\n");
+        } else if (strcmp(command, "def") == 0) {
+            print_location(file, file->index.declarations[declaration].offset);
+        } else if (strcmp(command, "refs") == 0) {
+            SymbolIndex* index = &file->index;
+            for (int i = first_reference(index, declaration);
+                 i < index->reference_count && index->references[i].declaration == declaration; i++) {
+                print_location(file, index->references[i].offset);
             }
-
-            args = realloc(args, (arg_count + 1) * sizeof(Expr*));
-            args[arg_count++] = parse_expression(parser);
-        } while (match(parser, TOKEN_COMMA));
-    }
-
-    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
-
-    Expr* expr = call_expr(parser->previous, args, arg_count);
-    free(args);
-    return expr;
-}
-
-Stmt* parse_declaration(Parser* parser) {
-    if (match(parser, TOKEN_VAR)) {
-        return parse_var_declaration(parser);
-    }
-
-    return parse_statement(parser);
-}
-
-Stmt* parse_var_declaration(Parser* parser) {
-    Token* name = consume(parser, TOKEN_IDENTIFIER, "Expect variable name.");
-
-    Expr* initializer = NULL;
-    if (match(parser, TOKEN_EQUAL)) {
-        initializer = parse_expression(parser);
-    }
-
-    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
-    return var_stmt(name, initializer);
-}
-
-Stmt* parse_statement(Parser* parser) {
-    if (match(parser, TOKEN_LEFT_BRACE)) {
-        return parse_block_statement(parser);
-    }
-
-    if (match(parser, TOKEN_IF)) {
-        return parse_if_statement(parser);
-    }
-
-    if (match(parser, TOKEN_WHILE)) {
-        return parse_while_statement(parser);
-    }
-
-    if (match(parser, TOKEN_FUNC)) {
-        return parse_func_declaration(parser);
-    }
-
-    if (match(parser, TOKEN_RETURN)) {
-        return parse_return_statement(parser);
-    }
-
-    return parse_expr_statement(parser);
-}
-
-Stmt* parse_expr_statement(Parser* parser) {
-    Expr* expr = parse_expression(parser);
-    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
-    return expr_stmt(expr);
-}
-
-Stmt* parse_block_statement(Parser* parser) {
-    Stmt** stmts = NULL;
-    int stmt_count = 0;
-
-    while (parser->current.type != TOKEN_RIGHT_BRACE && parser->current.type != TOKEN_EOF) {
-        stmts = realloc(stmts, (stmt_count + 1) * sizeof(Stmt*));
-        stmts[stmt_count++] = parse_declaration(parser);
+            printf("end\n");
+        } else if (strcmp(command, "hover") == 0) {
+            Declaration* decl = &file->index.declarations[declaration];
+            printf("%s %.*s\n", symbol_kind_names[decl->kind], decl->length, file->text + decl->offset);
+        } else {
+            printf("error\n");
+        }
+        fflush(stdout);
     }
 
-    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
-    return block_stmt(stmts, stmt_count);
+    free_workspace(&workspace);
 }
 
-Stmt* parse_if_statement(Parser* parser) {
-    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    Expr* condition = parse_expression(parser);
-    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after if condition.");
-
-    Stmt* then_branch = parse_statement(parser);
-    Stmt* else_branch = NULL;
+// Parse check
 
-    if (match(parser, TOKEN_ELSE)) {
-        else_branch = parse_statement(parser);
+void dump_expr(Expr* expr, StringPool* strings, FILE* out) {
+    if (expr == NULL) {
+        fprintf(out, "<error>");
+        return;
     }
 
-    return if_stmt(condition, then_branch, else_branch);
-}
-
-Stmt* parse_while_statement(Parser* parser) {
-    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    Expr* condition = parse_expression(parser);
-    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after while condition.");
-
-    Stmt* body = parse_statement(parser);
-
-    return while_stmt(condition, body);
-}
-
-Stmt* parse_func_declaration(Parser* parser) {
-    Token* name = consume(parser, TOKEN_IDENTIFIER, "Expect function name.");
-
-    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    Token* params = NULL;
-    int param_count = 0;
-
-    if (parser->current.type != TOKEN_RIGHT_PAREN) {
-        do {
-            if (param_count >= 255) {
-                error_at_current(parser, "Can't have more than 255 parameters.");
+    switch (expr->type) {
+        case EXPR_LITERAL:
+            if (expr->string_index != -1) {
+                int length;
+                const char* text = string_literal_text(strings, expr->string_index, &length);
+                fprintf(out, "\"");
+                for (int i = 0; i < length; i++) {
+                    unsigned char c = (unsigned char)text[i];
+                    if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+                    else if (c < 0x20) fprintf(out, "\\x%02x", c);
+                    else fputc(c, out);
+                }
+                fprintf(out, "\"");
+                break;
             }
-
-            params = realloc(params, (param_count + 1) * sizeof(Token*));
-            params[param_count++] = consume(parser, TOKEN_IDENTIFIER, "Expect parameter name.");
-        } while (match(parser, TOKEN_COMMA));
-    }
-
-    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-
-    Stmt** body = NULL;
-    int body_count = 0;
-
-    while (parser->current.type != TOKEN_RIGHT_BRACE && parser->current.type != TOKEN_EOF) {
-        body = realloc(body, (body_count + 1) * sizeof(Stmt*));
-        body[body_count++] = parse_declaration(parser);
-    }
-
-    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after function body.");
-
-    return func_stmt(name, params, param_count, body, body_count);
-}
-
-Stmt* parse_return_statement(Parser* parser) {
-    Token keyword = parser->previous;
-    Expr* value = NULL;
-
-    if (parser->current.type != TOKEN_SEMICOLON) {
-        value = parse_expression(parser);
-    }
-
-    consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
-    return return_stmt(keyword, value);
-}
-
-// Semantic analyzer functions
-
-void resolve_stmt(Stmt* stmt, Analyzer* analyzer) {
-    switch (stmt->type) {
-        case STMT_EXPR:
-            resolve_expr(stmt->expr, analyzer);
-            break;
-        case STMT_VAR:
-            resolve_var_decl(stmt->var_decl, analyzer);
-            break;
-        case STMT_BLOCK:
-            resolve_block_stmt(stmt, analyzer);
-            break;
-        case STMT_IF:
-            resolve_if_stmt(stmt, analyzer);
+            fprintf(out, "%.*s", expr->token.length, expr->token.start);
             break;
-        case STMT_WHILE:
-            resolve_while_stmt(stmt, analyzer);
-            break;
-        case STMT_FUNC:
-            resolve_func_decl(stmt, analyzer);
-            break;
-        case STMT_RETURN:
-            resolve_return_stmt(stmt, analyzer);
+        case EXPR_VARIABLE:
+            fprintf(out, "%.*s", expr->token.length, expr->token.start);
             break;
-    }
-}
-
-void resolve_expr(Expr* expr, Analyzer* analyzer) {
-    switch (expr->type) {
         case EXPR_BINARY:
-            resolve_binary_expr(expr, analyzer);
+        case EXPR_LOGICAL:
+            fprintf(out, "(%.*s ", expr->token.length, expr->token.start);
+            dump_expr(expr->left, strings, out);
+            fprintf(out, " ");
+            dump_expr(expr->right, strings, out);
+            fprintf(out, ")");
             break;
         case EXPR_UNARY:
-            resolve_unary_expr(expr, analyzer);
-            break;
-        case EXPR_LITERAL:
-            resolve_literal_expr(expr, analyzer);
+            fprintf(out, "(%.*s ", expr->token.length, expr->token.start);
+            dump_expr(expr->right, strings, out);
+            fprintf(out, ")");
             break;
         case EXPR_GROUPING:
-            resolve_grouping_expr(expr, analyzer);
-            break;
-        case EXPR_VARIABLE:
-            resolve_variable_expr(expr, analyzer);
+            fprintf(out, "(group ");
+            dump_expr(expr->expr, strings, out);
+            fprintf(out, ")");
             break;
         case EXPR_ASSIGN:
-            resolve_assign_expr(expr, analyzer);
-            break;
-        case EXPR_LOGICAL:
-            resolve_logical_expr(expr, analyzer);
+            fprintf(out, "(= %.*s ", expr->token.length, expr->token.start);
+            dump_expr(expr->right, strings, out);
+            fprintf(out, ")");
             break;
         case EXPR_CALL:
-            resolve_call_expr(expr, analyzer);
+            fprintf(out, "(call ");
+            dump_expr(expr->callee, strings, out);
+            for (int i = 0; i < expr->arg_count; i++) {
+                fprintf(out, " ");
+                dump_expr(expr->args[i], strings, out);
+            }
+            fprintf(out, ")");
             break;
     }
 }
 
-void resolve_var_decl(VarDecl var_decl, Analyzer* analyzer) {
-    declare_variable(analyzer, &var_decl.name, false);
-    if (var_decl.initializer != NULL) {
-        resolve_expr(var_decl.initializer, analyzer);
-    }
-    define_variable(analyzer, &var_decl.name);
-}
-
-void resolve_block_stmt(Stmt* stmt, Analyzer* analyzer) {
-    begin_scope(analyzer);
-    for (int i = 0; i < stmt->stmt_count; i++) {
-        resolve_stmt(stmt->stmts[i], analyzer);
-    }
-    end_scope(analyzer);
-}
-
-void resolve_if_stmt(Stmt* stmt, Analyzer* analyzer) {
-    resolve_expr(stmt->expr, analyzer);
-    resolve_stmt(stmt->then_branch, analyzer);
-    if (stmt->else_branch != NULL) {
-        resolve_stmt(stmt->else_branch, analyzer);
-    }
-}
-
-void resolve_while_stmt(Stmt* stmt, Analyzer* analyzer) {
-    resolve_expr(stmt->expr, analyzer);
-    resolve_stmt(stmt->stmts[0], analyzer);
-}
-
-void resolve_func_decl(Stmt* stmt, Analyzer* analyzer) {
-    declare_variable(analyzer, &stmt->name, false);
-    define_variable(analyzer, &stmt->name);
-
-    begin_scope(analyzer);
-    for (int i = 0; i < stmt->param_count; i++) {
-        declare_variable(analyzer, &stmt->params[i], false);
-        define_variable(analyzer, &stmt->params[i]);
+void dump_stmt(Stmt* stmt, int indent, StringPool* strings, FILE* out) {
+    fprintf(out, "%*s", indent * 2, "");
+    if (stmt == NULL) {
+        fprintf(out, "<error>\n");
+        return;
     }
 
-    for (int i = 0; i < stmt->stmt_count; i++) {
-        resolve_stmt(stmt->body[i], analyzer);
+    switch (stmt->type) {
+        case STMT_EXPR:
+            dump_expr(stmt->expr, strings, out);
+            fprintf(out, "\n");
+            break;
+        case STMT_VAR:
+            fprintf(out, "var %.*s", stmt->var_decl.name.length, stmt->var_decl.name.start);
+            if (stmt->var_decl.initializer != NULL) {
+                fprintf(out, " = ");
+                dump_expr(stmt->var_decl.initializer, strings, out);
+            }
+            fprintf(out, "\n");
+            break;
+        case STMT_RETURN:
+            fprintf(out, "return ");
+            if (stmt->expr != NULL) dump_expr(stmt->expr, strings, out);
+            fprintf(out, "\n");
+            break;
+        case STMT_BLOCK:
+        case STMT_WHILE:
+            fprintf(out, stmt->type == STMT_BLOCK ? "block\n" : "while ");
+            if (stmt->type == STMT_WHILE) {
+                dump_expr(stmt->expr, strings, out);
+                fprintf(out, "\n");
+            }
+            for (int i = 0; i < stmt->stmt_count; i++) dump_stmt(stmt->stmts[i], indent + 1, strings, out);
+            break;
+        case STMT_IF:
+            fprintf(out, "if ");
+            dump_expr(stmt->expr, strings, out);
+            fprintf(out, "\n");
+            dump_stmt(stmt->then_branch, indent + 1, strings, out);
+            if (stmt->else_branch != NULL) {
+                fprintf(out, "%*selse\n", indent * 2, "");
+                dump_stmt(stmt->else_branch, indent + 1, strings, out);
+            }
+            break;
+        case STMT_FUNC:
+            fprintf(out, "func %.*s(", stmt->name.length, stmt->name.start);
+            for (int i = 0; i < stmt->param_count; i++) {
+                fprintf(out, "%s%.*s", i > 0 ? ", " : "", stmt->params[i].length, stmt->params[i].start);
+            }
+            fprintf(out, ")\n");
+            for (int i = 0; i < stmt->stmt_count; i++) dump_stmt(stmt->body[i], indent + 1, strings, out);
+            break;
     }
-    end_scope(analyzer);
 }
 
-void resolve_return_stmt(Stmt* stmt, Analyzer* analyzer) {
-    if (stmt->expr != NULL) {
-        resolve_expr(stmt->expr, analyzer);
+// Returns the parsed AST and the diagnostics as text.
+char* dump_program(CompilerContext* context) {
+    size_t size = 0;
+    char* buffer = NULL;
+    FILE* out = open_memstream(&buffer, &size);
+    for (int i = 0; i < context->program.count; i++) {
+        dump_stmt(context->program.stmts[i], 0, &context->strings, out);
     }
+    render_diagnostics(&context->diagnostics, &context->source, out);
+    fclose(out);
+    return buffer;
 }
 
-void resolve_binary_expr(Expr* expr, Analyzer* analyzer) {
-    resolve_expr(expr->left, analyzer);
-    resolve_expr(expr->right, analyzer);
-}
-
-void resolve_unary_expr(Expr* expr, Analyzer* analyzer) {
-    resolve_expr(expr->right, analyzer);
-}
+// Parses `source` with the given split thresholds, for comparing serial and
+// parallel parses.
+char* dump_parse(CompilerContext* context, const char* source, int min_tokens, int min_range) {
+    reset_compiler_context(context);
+    context->source.text = source;
 
-void resolve_literal_expr(Expr* expr, Analyzer* analyzer) {
-    // No resolution needed for literal expressions
-}
+    Scanner scanner;
+    init_scanner(&scanner, source);
+    scan_program(context, &scanner);
+    parse_tokens(context, min_tokens, min_range);
+    return dump_program(context);
+}
+
+// Parses the file streamed in chunks of `chunk_size` bytes.
+char* dump_stream_parse(CompilerContext* context, const char* path, int chunk_size) {
+    reset_compiler_context(context);
+    context->source.text = NULL;
+
+    FILE* input = fopen(path, "rb");
+    if (input == NULL) return strdup("");
+    scan_stream_program(context, input, chunk_size);
+    fclose(input);
+    parse_tokens(context, INT_MAX, 1);
+    return dump_program(context);
+}
+
+// Parses each file serially, again split into the smallest ranges the
+// parallel parser allows, and again streamed in chunks small enough that
+// most tokens and comments cross a chunk boundary. All three must produce
+// the same AST and diagnostics.
+int run_parse_check(int count, char** paths) {
+    CompilerContext context;
+    init_compiler_context(&context);
+
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        char* source = read_file(paths[i]);
+        if (source == NULL) {
+            fprintf(stderr, "Could not read \"%s\".\n", paths[i]);
+            failures++;
+            continue;
+        }
 
-void resolve_grouping_expr(Expr* expr, Analyzer* analyzer) {
-    resolve_expr(expr->expr, analyzer);
-}
+        char* serial = dump_parse(&context, source, INT_MAX, 1);
+        char* parallel = dump_parse(&context, source, 1, 1);
+        char* streamed = dump_stream_parse(&context, paths[i], 3);
+        bool same = strcmp(serial, parallel) == 0 && strcmp(serial, streamed) == 0;
+        printf("%s %s\n", same ? "ok  " : "FAIL", paths[i]);
+        if (!same) {
+            printf("--- serial\n%s--- parallel\n%s--- streamed\n%s", serial, parallel, streamed);
+            failures++;
+        }
 
-void resolve_variable_expr(Expr* expr, Analyzer* analyzer) {
-    if (analyzer->current->variables.count > 0 &&
-        lookup_variable(analyzer->current, expr->name) == NULL) {
-        error(&expr->token, "Cannot read local variable in its own initializer.");
+        free(streamed);
+        free(parallel);
+        free(serial);
+        free(source);
     }
-    resolve_local(analyzer, expr, expr->name);
-}
 
-void resolve_assign_expr(Expr* expr, Analyzer* analyzer) {
-    resolve_expr(expr->right, analyzer);
-    resolve_local(analyzer, expr, &expr->token);
+    free_compiler_context(&context);
+    return failures;
 }
 
-void resolve_logical_expr(Expr* expr, Analyzer* analyzer) {
-    resolve_expr(expr->left, analyzer);
-    resolve_expr(expr->right, analyzer);
-}
+// Analysis dump
 
-void resolve_call_expr(Expr* expr, Analyzer* analyzer) {
-    resolve_expr(expr->callee, analyzer);
+const char* value_type_names[] = {
+    [TYPE_NONE] = "none",
+    [TYPE_NUMBER] = "number",
+    [TYPE_BOOL] = "bool",
+    [TYPE_STRING] = "string",
+    [TYPE_NIL] = "nil",
+    [TYPE_UNKNOWN] = "unknown",
+};
 
-    for (int i = 0; i < expr->arg_count; i++) {
-        resolve_expr(expr->args[i], analyzer);
+// Prints the declarations of a resolved program with what the resolver and
+// type inference worked out about them: the type of each variable,
+// parameter and return value, which are captured by a closure, and which
+// upvalues each function closes over. Expressions are left out.
+void dump_declarations(Stmt* stmt, int indent, FILE* out) {
+    switch (stmt->type) {
+        case STMT_VAR:
+            fprintf(out, "%*svar %.*s: %s%s\n", indent * 2, "", stmt->var_decl.name.length, stmt->var_decl.name.start,
+                    value_type_names[stmt->var_decl.type], stmt->var_decl.is_captured ? " captured" : "");
+            break;
+        case STMT_BLOCK:
+        case STMT_WHILE:
+            fprintf(out, "%*s%s\n", indent * 2, "", stmt->type == STMT_BLOCK ? "block" : "while");
+            for (int i = 0; i < stmt->stmt_count; i++) dump_declarations(stmt->stmts[i], indent + 1, out);
+            break;
+        case STMT_IF:
+            fprintf(out, "%*sif\n", indent * 2, "");
+            dump_declarations(stmt->then_branch, indent + 1, out);
+            if (stmt->else_branch != NULL) {
+                fprintf(out, "%*selse\n", indent * 2, "");
+                dump_declarations(stmt->else_branch, indent + 1, out);
+            }
+            break;
+        case STMT_FUNC:
+            fprintf(out, "%*sfunc %.*s(", indent * 2, "", stmt->name.length, stmt->name.start);
+            for (int i = 0; i < stmt->param_count; i++) {
+                fprintf(out, "%s%.*s: %s%s", i > 0 ? ", " : "", stmt->params[i].length, stmt->params[i].start,
+                        value_type_names[stmt->param_types[i]], stmt->captured_params[i] ? " captured" : "");
+            }
+            fprintf(out, ") -> %s%s\n", value_type_names[stmt->return_type], stmt->is_captured ? " captured" : "");
+            if (stmt->upvalue_count > 0) {
+                fprintf(out, "%*supvalues", (indent + 1) * 2, "");
+                for (int i = 0; i < stmt->upvalue_count; i++) {
+                    Upvalue* upvalue = &stmt->upvalues[i];
+                    fprintf(out, " %.*s(%s %d)", upvalue->name.length, upvalue->name.start,
+                            upvalue->is_local ? "local" : "upvalue", upvalue->index);
+                }
+                fprintf(out, "\n");
+            }
+            for (int i = 0; i < stmt->stmt_count; i++) dump_declarations(stmt->body[i], indent + 1, out);
+            break;
+        default:
+            break;
     }
 }
 
-// Variable array functions
-
-void init_variable_array(VariableArray* array) {
-    array->variables = NULL;
-    array->capacity = 0;
-    array->count = 0;
-}
-
-void free_variable_array(VariableArray* array) {
-    free(array->variables);
-    init_variable_array(array);
-}
-
-void write_variable(VariableArray* array, Token* name, bool is_const) {
-    if (array->capacity < array->count + 1) {
-        int new_capacity = array->capacity < 8 ? 8 : array->capacity * 2;
-        array->variables = realloc(array->variables, new_capacity * sizeof(Variable));
-        array->capacity = new_capacity;
+// Compiles one file and prints the declarations left after pruning, or its
+// diagnostics if it does not compile. The output is compared against
+// tests/*.expected.
+int run_dump(const char* path) {
+    char* source = read_file(path);
+    if (source == NULL) {
+        fprintf(stderr, "Could not read \"%s\".\n", path);
+        return 1;
     }
 
-    array->variables[array->count].name = name->start;
-    array->variables[array->count].depth = array->count;
-    array->variables[array->count].is_const = is_const;
-    array->count++;
-}
-
-bool resolve_local(Analyzer* analyzer, Expr* expr, Token* name) {
-    for (int i = analyzer->current->variables.count - 1; i >= 0; i--) {
-        Variable* variable = &analyzer->current->variables.variables[i];
-        if (variable->depth != -1 && variable->depth < analyzer->current->variables.count) {
-            break;
+    CompilerContext context;
+    init_compiler_context(&context);
+    bool ok = compile(&context, source);
+    if (ok) {
+        for (int i = 0; i < context.program.count; i++) {
+            dump_declarations(context.program.stmts[i], 0, stdout);
         }
-
-        if (memcmp(name->start, variable->name, name->length) == 0 && name->length == strlen(variable->name)) {
-            expr->variable.depth = analyzer->current->variables.count - variable->depth;
-            expr->variable.is_captured = false;
-            return true;
+        printf("pruned %d of %d functions\n", context.pruned_count, context.function_count);
+        printf("typed %d of %d expressions\n", context.typed_count, context.expr_count);
+    }
+    render_diagnostics(&context.diagnostics, &context.source, stdout);
+
+    free_compiler_context(&context);
+    free(source);
+    return ok ? 0 : 1;
+}
+
+// Type statistics
+
+// Compiles each file on one context and reports how many expressions got a
+// static type, per file and over the whole set. Files that fail to compile
+// are listed but left out of the total.
+int run_type_stats(int count, char** paths) {
+    CompilerContext context;
+    init_compiler_context(&context);
+
+    long typed = 0;
+    long total = 0;
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        char* source = read_file(paths[i]);
+        if (source == NULL) {
+            fprintf(stderr, "Could not read \"%s\".\n", paths[i]);
+            failures++;
+            continue;
         }
-    }
-
-    return false;
-}
 
-void declare_variable(Analyzer* analyzer, Token* name, bool is_const) {
-    if (analyzer->current->variables.count == 0) return;
-
-    for (int i = analyzer->current->variables.count - 1; i >= 0; i--) {
-        Variable* variable = &analyzer->current->variables.variables[i];
-        if (variable->depth != -1 && variable->depth < analyzer->current->variables.count) {
-            break;
+        if (compile(&context, source)) {
+            int file_total = context.expr_count;
+            printf("%6.1f%%  %6d/%-6d %s\n", file_total > 0 ? 100.0 * context.typed_count / file_total : 0.0,
+                   context.typed_count, file_total, paths[i]);
+            typed += context.typed_count;
+            total += file_total;
+        } else {
+            printf("errors                 %s\n", paths[i]);
+            failures++;
         }
-
-        if (memcmp(name->start, variable->name, name->length) == 0 && name->length == strlen(variable->name)) {
-            error(name, "Variable with this name already declared in this scope.");
+        free(source);
+    }
+
+    printf("%6.1f%%  %6ld/%-6ld total over %d file%s\n", total > 0 ? 100.0 * typed / total : 0.0,
+           typed, total, count - failures, count - failures == 1 ? "" : "s");
+    free_compiler_context(&context);
+    return failures;
+}
+
+// Nesting benchmark
+
+// Returns `prefix`, then `depth` copies of `open`, then `inner`, then
+// `depth` copies of `close`, then `suffix`.
+char* nested_source(const char* prefix, const char* open, const char* inner, const char* close, const char* suffix,
+                    int depth) {
+    size_t prefix_length = strlen(prefix);
+    size_t open_length = strlen(open);
+    size_t inner_length = strlen(inner);
+    size_t close_length = strlen(close);
+    size_t suffix_length = strlen(suffix);
+
+    char* source = malloc(prefix_length + depth * (open_length + close_length) + inner_length + suffix_length + 1);
+    char* end = source;
+    memcpy(end, prefix, prefix_length);
+    end += prefix_length;
+    for (int i = 0; i < depth; i++, end += open_length) memcpy(end, open, open_length);
+    memcpy(end, inner, inner_length);
+    end += inner_length;
+    for (int i = 0; i < depth; i++, end += close_length) memcpy(end, close, close_length);
+    memcpy(end, suffix, suffix_length);
+    end += suffix_length;
+    *end = '\0';
+    return source;
+}
+
+// Times a full compile of the nested source.
+void bench_nesting(CompilerContext* context, const char* label, char* source, int depth) {
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ok = compile(context, source);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("%-6s depth %6d: %9.3f ms%s\n", label, depth, elapsed, ok ? "" : " (errors)");
+    free(source);
+}
+
+void run_nesting_benchmark() {
+    int depths[] = {10, 1000, 100000};
+
+    CompilerContext context;
+    init_compiler_context(&context);
+
+    for (int i = 0; i < 3; i++) {
+        int depth = depths[i];
+        bench_nesting(&context, "block", nested_source("var x = 0;\n", "{ ", "x = x + 1;", " }", "", depth), depth);
+        bench_nesting(&context, "if", nested_source("var x = 0;\n", "if (x) ", "x = 1;", "", "", depth), depth);
+        bench_nesting(&context, "unary", nested_source("var x = 0;\nx = ", "!", "x;", "", "", depth), depth);
+        bench_nesting(&context, "group", nested_source("var x = 0;\nx = ", "(", "x", ")", ";", depth), depth);
+        bench_nesting(&context, "call", nested_source("func f(a) { return a; }\n", "f(", "0", ")", ";", depth), depth);
+    }
+
+    free_compiler_context(&context);
+}
+
+// Scaling benchmark
+
+// A module of `count` independent functions with a few locals and a closure
+// each, large enough that both parsing and resolution split across workers.
+char* module_source(int count) {
+    const char* format =
+        "func f%d(a, b) {\n"
+        "    var total = a + b;\n"
+        "    var i = 0;\n"
+        "    while (i < b) { total = total * 2 - i; i = i + 1; }\n"
+        "    func inner(c) { return total + c; }\n"
+        "    if (total > 100) { return inner(total); } else { return inner(a); }\n"
+        "}\n";
+    size_t capacity = (size_t)count * (strlen(format) + 16) + 64;
+    char* source = malloc(capacity);
+    size_t length = 0;
+    for (int i = 0; i < count; i++) {
+        length += snprintf(source + length, capacity - length, format, i);
+    }
+    snprintf(source + length, capacity - length, "var result = f0(1, 2);\n");
+    return source;
+}
+
+void run_scaling_benchmark(int function_count) {
+    char* source = module_source(function_count);
+    int workers = worker_total();
+
+    CompilerContext context;
+    init_compiler_context(&context);
+    compile(&context, source);
+    printf("%d functions, %d tokens, %d worker%s available\n", function_count, context.tokens.count,
+           workers, workers == 1 ? "" : "s");
+
+    double baseline = 0;
+    for (int limit = 1; limit <= workers; limit *= 2) {
+        set_worker_limit(limit);
+
+        // Best of several runs; the first compile above warmed the context.
+        double best = 0;
+        for (int run = 0; run < 5; run++) {
+            struct timespec start;
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            compile(&context, source);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double elapsed = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+            if (run == 0 || elapsed < best) best = elapsed;
         }
-    }
-
-    write_variable(&analyzer->current->variables, name, is_const);
-}
 
-void define_variable(Analyzer* analyzer, Token* name) {
-    if (analyzer->current->variables.count == 0) return;
-    analyzer->current->variables.variables[analyzer->current->variables.count - 1].depth = analyzer->current->variables.count;
-}
-
-void define_variable(Analyzer* analyzer, Token* name) {
-    if (analyzer->current->variables.count == 0) return;
-    analyzer->current->variables.variables[analyzer->current->variables.count - 1].depth = analyzer->current->variables.count;
-}
-// Scope functions
-
-Scope* new_scope(Scope* enclosing) {
-    Scope* scope = malloc(sizeof(Scope));
-    scope->enclosing = enclosing;
-    init_variable_array(&scope->variables);
-    return scope;
-}
-
-void free_scope(Scope* scope) {
-    free_variable_array(&scope->variables);
-    free(scope);
-}
-
-void begin_scope(Analyzer* analyzer) {
-    Scope* scope = new_scope(analyzer->current);
-    analyzer->current = scope;
-}
-
-void end_scope(Analyzer* analyzer) {
-    Scope* scope = analyzer->current;
-    analyzer->current = scope->enclosing;
-    free_scope(scope);
-}
-
-// Error handling functions
-
-void error(Token* token, const char* message) {
-    if (token->type == TOKEN_EOF) {
-        fprintf(stderr, "[line %d] Error at end: %s\n", token->line, message);
-    } else {
-        fprintf(stderr, "[line %d] Error at '%.*s': %s\n", token->line, token->length, token->start, message);
+        if (limit == 1) baseline = best;
+        printf("%2d worker%s: %9.3f ms  %.2fx\n", limit, limit == 1 ? " " : "s", best, baseline / best);
+        if (limit < workers && limit * 2 > workers) limit = workers / 2;
     }
-}
 
-void error_at_current(Parser* parser, const char* message) {
-    error(&parser->current, message);
+    set_worker_limit(MAX_WORKERS);
+    free_compiler_context(&context);
+    free(source);
 }
 
-void error_at_previous(Parser* parser, const char* message) {
-    error(&parser->previous, message);
-}
-// Parsing and resolution functions
+// Main function
 
-Stmt* parse(Scanner* scanner) {
-    Parser parser;
-    parser.current = scan_token(scanner);
-    parser.previous = parser.current;
-    parser.had_error = false;
-    parser.panic_mode = false;
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "--bench-nesting") == 0) {
+        run_nesting_benchmark();
+        return 0;
+    }
 
-    Stmt* stmt = parse_declaration(&parser);
+    if (argc > 1 && strcmp(argv[1], "--bench-scaling") == 0) {
+        run_scaling_benchmark(argc > 2 ? atoi(argv[2]) : 20000);
+        return 0;
+    }
 
-    if (parser.had_error) {
-        // Handle parsing error
-        return NULL;
+    if (argc > 1 && strcmp(argv[1], "--type-stats") == 0) {
+        return run_type_stats(argc - 2, argv + 2) == 0 ? 0 : 1;
     }
 
-    return stmt;
-}
+    if (argc > 1 && strcmp(argv[1], "--check-parse") == 0) {
+        return run_parse_check(argc - 2, argv + 2) == 0 ? 0 : 1;
+    }
 
-void resolve(Stmt* stmt, Analyzer* analyzer) {
-    resolve_stmt(stmt, analyzer);
-}
+    if (argc > 2 && strcmp(argv[1], "--dump") == 0) {
+        return run_dump(argv[2]);
+    }
 
-// Main function
+    if (argc > 1 && strcmp(argv[1], "--daemon") == 0) {
+        run_daemon();
+        return 0;
+    }
 
-int main() {
     const char* input_code = "\n"
         "\"example\" # STRING\n"
         "{ # LEFT_BRACE\n"
@@ -916,27 +665,27 @@ int main() {
         "    print(\"Hello, \" + name + \"!\")\n"
         "greet(\"World\")\n";
 
-    Scanner scanner;
-    init_scanner(&scanner, input_code);
+    CompilerContext context;
+    init_compiler_context(&context);
 
-    Stmt* stmt = parse(&scanner);
-    if (stmt == NULL) {
-        printf("Parsing failed.\n");
+    // `-` compiles the program streamed on stdin instead of the sample.
+    bool ok = argc > 1 && strcmp(argv[1], "-") == 0 ? compile_stream(&context, stdin) : compile(&context, input_code);
+    if (!ok) {
+        render_diagnostics(&context.diagnostics, &context.source, stderr);
+        printf("Compilation failed.\n");
+        free_compiler_context(&context);
         return 1;
     }
 
-    Analyzer analyzer;
-    Scope global_scope;
-    init_variable_array(&global_scope.variables);
-    global_scope.enclosing = NULL;
-    analyzer.current = &global_scope;
-
-    resolve(stmt, &analyzer);
+    int typed = context.typed_count;
+    int total = context.expr_count;
+    printf("Typed %d of %d expressions (%.1f%%)\n", typed, total, total > 0 ? 100.0 * typed / total : 0.0);
+    printf("Pruned %d of %d functions\n", context.pruned_count, context.function_count);
 
     // Execute the parsed and analyzed code
     // ...
 
-    free_scope(&global_scope);
+    free_compiler_context(&context);
 
     return 0;
 }
\ No newline at end of file
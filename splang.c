@@ -0,0 +1,3489 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "splang.h"
+
+// Function declarations
+
+void resolve_program(StmtArray* program, Analyzer* analyzer, Worker* workers);
+void infer_types(TypeChecker* checker, StmtArray* program, int* typed, int* total);
+void queue_unit(TypeChecker* checker, int index);
+int first_reader(TypeChecker* checker, ValueType* cell);
+void read_cell(TypeChecker* checker, ValueType* cell);
+int record_scope(SymbolIndex* index, int64_t start, int64_t end);
+int record_declaration(SymbolIndex* index, Token* name, SymbolKind kind, int scope);
+void record_reference(SymbolIndex* index, Token* name, int declaration);
+
+void write_stmt(StmtArray* array, Stmt* stmt);
+void write_expr(ExprArray* array, Expr* expr);
+void write_line_start(LineIndex* lines, int64_t offset);
+void error_at(Parser* parser, Token* token, DiagnosticCode code, const char* message);
+void analyzer_error(Analyzer* analyzer, Token* token, DiagnosticCode code, const char* message);
+
+void advance_token(Parser* parser);
+bool match_token(Parser* parser, TokenType type);
+Token consume(Parser* parser, TokenType type, const char* message);
+Expr* parse_primary(Parser* parser);
+
+void begin_scope(Analyzer* analyzer, Stmt* owner);
+void end_scope(Analyzer* analyzer);
+void declare_variable(Analyzer* analyzer, Token* name, SymbolKind kind, bool is_const, bool* captured, ValueType* type);
+void define_variable(Analyzer* analyzer, Token* name);
+int find_variable(Scope* scope, Token* name);
+bool resolve_local(Analyzer* analyzer, Expr* expr, Token* name);
+// Scanner functions
+
+void init_scanner(Scanner* scanner, const char* source) {
+    scanner->source = source;
+    scanner->start = source;
+    scanner->current = source;
+    scanner->base = 0;
+}
+
+bool is_at_end(Scanner* scanner) {
+    return *scanner->current == '\0';
+}
+
+char advance(Scanner* scanner) {
+    scanner->current++;
+    return scanner->current[-1];
+}
+
+bool match(Scanner* scanner, char expected) {
+    if (is_at_end(scanner)) return false;
+    if (*scanner->current != expected) return false;
+    scanner->current++;
+    return true;
+}
+
+Token make_token(Scanner* scanner, TokenType type) {
+    Token token;
+    token.type = type;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.offset = scanner->base + (scanner->start - scanner->source);
+    token.string_index = -1;
+    return token;
+}
+
+// Error tokens carry their diagnostic code in string_index.
+Token error_token(Scanner* scanner, DiagnosticCode code, const char* message) {
+    Token token;
+    token.type = TOKEN_ERROR;
+    token.start = message;
+    token.length = (int)strlen(message);
+    token.offset = scanner->base + (scanner->start - scanner->source);
+    token.string_index = -1;
+    token.error_code = code;
+    return token;
+}
+
+void skip_whitespace(Scanner* scanner) {
+    for (;;) {
+        char c = *scanner->current;
+        switch (c) {
+            case ' ':
+            case '\r':
+            case '\t':
+            case '\n':
+                advance(scanner);
+                break;
+            case '#':
+                while (*scanner->current != '\n' && !is_at_end(scanner)) advance(scanner);
+                break;
+            default:
+                return;
+        }
+    }
+}
+
+Token string(Scanner* scanner) {
+    while (*scanner->current != '"' && !is_at_end(scanner)) {
+        if (*scanner->current == '\\' && scanner->current[1] != '\0') advance(scanner);
+        advance(scanner);
+    }
+
+    if (is_at_end(scanner)) return error_token(scanner, DIAG_UNTERMINATED_STRING, "Unterminated string.");
+
+    advance(scanner);
+    return make_token(scanner, TOKEN_STRING);
+}
+
+bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+Token number(Scanner* scanner) {
+    while (is_digit(*scanner->current)) advance(scanner);
+
+    if (*scanner->current == '.' && is_digit(scanner->current[1])) {
+        advance(scanner);
+        while (is_digit(*scanner->current)) advance(scanner);
+    }
+
+    return make_token(scanner, TOKEN_NUMBER);
+}
+
+bool is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+TokenType check_keyword(Scanner* scanner, int start, int length, const char* rest, TokenType type) {
+    if (scanner->current - scanner->start == start + length &&
+        memcmp(scanner->start + start, rest, length) == 0) {
+        return type;
+    }
+
+    return TOKEN_IDENTIFIER;
+}
+
+TokenType identifier_type(Scanner* scanner) {
+    switch (scanner->start[0]) {
+        case 'a': return check_keyword(scanner, 1, 2, "nd", TOKEN_AND);
+        case 'c':
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'l': return check_keyword(scanner, 2, 3, "ass", TOKEN_CLASS);
+                    case 'o': return check_keyword(scanner, 2, 3, "nst", TOKEN_VAR);
+                }
+            }
+            break;
+        case 'e': return check_keyword(scanner, 1, 3, "lse", TOKEN_ELSE);
+        case 'f':
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'a': return check_keyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+                    case 'o': return check_keyword(scanner, 2, 1, "r", TOKEN_FOR);
+                    case 'u': return check_keyword(scanner, 2, 2, "nc", TOKEN_FUNC);
+                }
+            }
+            break;
+        case 'i': return check_keyword(scanner, 1, 1, "f", TOKEN_IF);
+        case 'n': return check_keyword(scanner, 1, 2, "il", TOKEN_NIL);
+        case 'o': return check_keyword(scanner, 1, 1, "r", TOKEN_OR);
+        case 'r': return check_keyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
+        case 't': return check_keyword(scanner, 1, 3, "rue", TOKEN_TRUE);
+        case 'v': return check_keyword(scanner, 1, 2, "ar", TOKEN_VAR);
+        case 'w': return check_keyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+    }
+
+    return TOKEN_IDENTIFIER;
+}
+
+Token identifier(Scanner* scanner) {
+    while (is_alpha(*scanner->current) || is_digit(*scanner->current)) advance(scanner);
+    return make_token(scanner, identifier_type(scanner));
+}
+
+Token scan_token(Scanner* scanner) {
+    skip_whitespace(scanner);
+
+    scanner->start = scanner->current;
+
+    if (is_at_end(scanner)) return make_token(scanner, TOKEN_EOF);
+
+    char c = advance(scanner);
+
+    if (is_alpha(c)) return identifier(scanner);
+    if (is_digit(c)) return number(scanner);
+
+    switch (c) {
+        case '(': return make_token(scanner, TOKEN_LEFT_PAREN);
+        case ')': return make_token(scanner, TOKEN_RIGHT_PAREN);
+        case '{': return make_token(scanner, TOKEN_LEFT_BRACE);
+        case '}': return make_token(scanner, TOKEN_RIGHT_BRACE);
+        case ';': return make_token(scanner, TOKEN_SEMICOLON);
+        case ',': return make_token(scanner, TOKEN_COMMA);
+        case '.': return make_token(scanner, TOKEN_DOT);
+        case '-': return make_token(scanner, TOKEN_MINUS);
+        case '+': return make_token(scanner, TOKEN_PLUS);
+        case '/': return make_token(scanner, TOKEN_SLASH);
+        case '*':
+            return make_token(scanner, match(scanner, '*') ? TOKEN_POWER : TOKEN_STAR);
+        case '!':
+            return make_token(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        case '=':
+            return make_token(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        case '<':
+            return make_token(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+        case '>':
+            return make_token(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        case '"': return string(scanner);
+    }
+
+    return error_token(scanner, DIAG_UNEXPECTED_CHARACTER, "Unexpected character.");
+}
+
+// Token array functions
+
+void init_token_array(TokenArray* array) {
+    array->tokens = NULL;
+    array->capacity = 0;
+    array->count = 0;
+}
+
+void free_token_array(TokenArray* array) {
+    free(array->tokens);
+    init_token_array(array);
+}
+
+void write_token(TokenArray* array, Token token) {
+    if (array->capacity < array->count + 1) {
+        int new_capacity = array->capacity < 64 ? 64 : array->capacity * 2;
+        array->tokens = realloc(array->tokens, new_capacity * sizeof(Token));
+        array->capacity = new_capacity;
+    }
+
+    array->tokens[array->count++] = token;
+}
+
+void scan_all_tokens(Scanner* scanner, TokenArray* array) {
+    for (;;) {
+        Token token = scan_token(scanner);
+        write_token(array, token);
+        if (token.type == TOKEN_EOF) break;
+    }
+}
+
+// Arena functions
+
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGNMENT 16
+
+void init_arena(Arena* arena) {
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
+void free_arena(Arena* arena) {
+    ArenaBlock* block = arena->first;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    init_arena(arena);
+}
+
+// Keeps every block for the next compile; only the fill levels are cleared.
+void reset_arena(Arena* arena) {
+    for (ArenaBlock* block = arena->first; block != NULL; block = block->next) {
+        block->used = 0;
+    }
+    arena->current = arena->first;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    while (arena->current != NULL) {
+        ArenaBlock* block = arena->current;
+        if (block->capacity - block->used >= size) {
+            void* memory = block->data + block->used;
+            block->used += size;
+            return memory;
+        }
+        if (block->next == NULL) break;
+        arena->current = block->next;
+    }
+
+    size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + capacity);
+    block->next = NULL;
+    block->capacity = capacity;
+    block->used = size;
+
+    if (arena->current != NULL) {
+        arena->current->next = block;
+    } else {
+        arena->first = block;
+    }
+    arena->current = block;
+    return block->data;
+}
+
+// Allocates from the arena when there is one, otherwise from the heap.
+void* allocate(Arena* arena, size_t size) {
+    return arena != NULL ? arena_alloc(arena, size) : malloc(size);
+}
+
+void* reallocate(Arena* arena, void* memory, size_t old_size, size_t new_size) {
+    if (arena == NULL) return realloc(memory, new_size);
+
+    void* grown = arena_alloc(arena, new_size);
+    if (old_size > 0) memcpy(grown, memory, old_size);
+    return grown;
+}
+
+// Stream scanner functions
+
+// When `lines` is given, the start of every line is recorded as chunks are
+// read, so locations can be reported without keeping the text.
+void init_stream_scanner(StreamScanner* stream, FILE* input, LineIndex* lines) {
+    stream->input = input;
+    for (int i = 0; i < STREAM_RING_SIZE; i++) {
+        stream->ring[i].data = NULL;
+        stream->ring[i].capacity = 0;
+    }
+    stream->active = STREAM_RING_SIZE - 1;
+    stream->chunk_size = STREAM_CHUNK_SIZE;
+    stream->data_end = NULL;
+    stream->at_eof = false;
+    stream->in_comment = false;
+    stream->lines = lines;
+    if (lines != NULL) {
+        lines->count = 0;
+        write_line_start(lines, 0);
+    }
+    init_scanner(&stream->scanner, "");
+}
+
+void free_stream_scanner(StreamScanner* stream) {
+    for (int i = 0; i < STREAM_RING_SIZE; i++) {
+        free(stream->ring[i].data);
+        stream->ring[i].data = NULL;
+        stream->ring[i].capacity = 0;
+    }
+}
+
+// Moves to the next buffer in the ring, copies the unfinished token to its
+// front and reads one chunk after it. Buffers only grow past one chunk when a
+// single token is longer than a chunk. With no token to carry, pass the end
+// of the current data and a length of 0.
+void fill_stream(StreamScanner* stream, const char* carry, int carry_length) {
+    int64_t base = stream->data_end != NULL ? stream->scanner.base + (carry - stream->scanner.source) : 0;
+
+    stream->active = (stream->active + 1) % STREAM_RING_SIZE;
+    StreamBuffer* buffer = &stream->ring[stream->active];
+
+    int needed = carry_length + stream->chunk_size + 1;
+    if (buffer->capacity < needed) {
+        buffer->data = realloc(buffer->data, needed);
+        buffer->capacity = needed;
+    }
+
+    if (carry_length > 0) memmove(buffer->data, carry, carry_length);
+
+    char* chunk = buffer->data + carry_length;
+    size_t read = fread(chunk, 1, stream->chunk_size, stream->input);
+    if (read < (size_t)stream->chunk_size) stream->at_eof = true;
+
+    if (stream->lines != NULL) {
+        int64_t chunk_base = base + carry_length;
+        for (char* newline = memchr(chunk, '\n', read); newline != NULL;
+             newline = memchr(newline + 1, '\n', chunk + read - newline - 1)) {
+            write_line_start(stream->lines, chunk_base + (newline + 1 - chunk));
+        }
+    }
+
+    int length = carry_length + (int)read;
+    buffer->data[length] = '\0';
+    stream->data_end = buffer->data + length;
+    stream->scanner.source = buffer->data;
+    stream->scanner.start = buffer->data;
+    stream->scanner.current = buffer->data;
+    stream->scanner.base = base;
+}
+
+// Skips whitespace and comments, reading more chunks as it goes. Trivia is
+// never carried into the next buffer, so a comment of any length costs one
+// pass and no memory; `in_comment` remembers a comment cut by a chunk end.
+void skip_stream_trivia(StreamScanner* stream) {
+    Scanner* scanner = &stream->scanner;
+
+    for (;;) {
+        if (stream->in_comment) {
+            const char* newline = memchr(scanner->current, '\n', stream->data_end - scanner->current);
+            scanner->current = newline != NULL ? newline : stream->data_end;
+            stream->in_comment = newline == NULL;
+        }
+
+        while (scanner->current < stream->data_end) {
+            char c = *scanner->current;
+            if (c == ' ' || c == '\r' || c == '\t' || c == '\n') {
+                scanner->current++;
+            } else if (c == '#') {
+                stream->in_comment = true;
+                break;
+            } else {
+                return;
+            }
+        }
+
+        if (stream->in_comment && scanner->current < stream->data_end) continue;
+        if (stream->at_eof) return;
+        fill_stream(stream, stream->data_end, 0);
+    }
+}
+
+// Tokens point into the ring and stay valid until STREAM_RING_SIZE - 1 more
+// chunks have been read, so consumers must copy anything they keep longer.
+Token stream_scan_token(StreamScanner* stream) {
+    if (stream->data_end == NULL) fill_stream(stream, NULL, 0);
+
+    for (;;) {
+        skip_stream_trivia(stream);
+        Token token = scan_token(&stream->scanner);
+
+        // The scanner peeks up to two characters past a token, so anything
+        // ending that close to the chunk end may still continue in the next
+        // one. Only the token itself is carried over and scanned again.
+        if (stream->at_eof || stream->data_end - stream->scanner.current >= 2) return token;
+
+        fill_stream(stream, stream->scanner.start, (int)(stream->data_end - stream->scanner.start));
+    }
+}
+
+void scan_stream(FILE* input, int chunk_size, LineIndex* lines, TokenSink sink, void* context) {
+    StreamScanner stream;
+    init_stream_scanner(&stream, input, lines);
+    stream.chunk_size = chunk_size;
+
+    for (;;) {
+        Token token = stream_scan_token(&stream);
+        sink(&token, context);
+        if (token.type == TOKEN_EOF) break;
+    }
+
+    free_stream_scanner(&stream);
+}
+
+// String pool functions
+
+void init_string_pool(StringPool* pool, Arena* arena) {
+    pool->literals = NULL;
+    pool->capacity = 0;
+    pool->count = 0;
+    pool->table = NULL;
+    pool->table_capacity = 0;
+    pool->arena = arena;
+    pthread_mutex_init(&pool->lock, NULL);
+}
+
+void free_string_pool(StringPool* pool) {
+    if (pool->arena == NULL) {
+        for (int i = 0; i < pool->count; i++) {
+            free(pool->literals[i].decoded);
+        }
+    }
+    free(pool->literals);
+    free(pool->table);
+    pthread_mutex_destroy(&pool->lock);
+    init_string_pool(pool, pool->arena);
+}
+
+void reset_string_pool(StringPool* pool) {
+    if (pool->arena == NULL) {
+        for (int i = 0; i < pool->count; i++) {
+            free(pool->literals[i].decoded);
+        }
+    }
+    pool->count = 0;
+    for (int i = 0; i < pool->table_capacity; i++) pool->table[i] = -1;
+}
+
+uint32_t hash_string(const char* start, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)start[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+void grow_string_table(StringPool* pool) {
+    int new_capacity = pool->table_capacity < 16 ? 16 : pool->table_capacity * 2;
+    int* table = malloc(new_capacity * sizeof(int));
+    for (int i = 0; i < new_capacity; i++) table[i] = -1;
+
+    for (int i = 0; i < pool->count; i++) {
+        uint32_t slot = pool->literals[i].hash & (new_capacity - 1);
+        while (table[slot] != -1) slot = (slot + 1) & (new_capacity - 1);
+        table[slot] = i;
+    }
+
+    free(pool->table);
+    pool->table = table;
+    pool->table_capacity = new_capacity;
+}
+
+// Interns the literal's contents (quotes excluded) as a view into the source.
+// Identical spellings share one entry; nothing is copied or decoded here.
+int intern_string(StringPool* pool, const char* start, int length) {
+    if ((pool->count + 1) * 4 > pool->table_capacity * 3) grow_string_table(pool);
+
+    uint32_t hash = hash_string(start, length);
+    uint32_t slot = hash & (pool->table_capacity - 1);
+    while (pool->table[slot] != -1) {
+        StringLiteral* literal = &pool->literals[pool->table[slot]];
+        if (literal->hash == hash && literal->length == length && memcmp(literal->start, start, length) == 0) {
+            return pool->table[slot];
+        }
+        slot = (slot + 1) & (pool->table_capacity - 1);
+    }
+
+    if (pool->capacity < pool->count + 1) {
+        int new_capacity = pool->capacity < 8 ? 8 : pool->capacity * 2;
+        pool->literals = realloc(pool->literals, new_capacity * sizeof(StringLiteral));
+        pool->capacity = new_capacity;
+    }
+
+    StringLiteral* literal = &pool->literals[pool->count];
+    literal->start = start;
+    literal->length = length;
+    literal->hash = hash;
+    literal->has_escapes = memchr(start, '\\', length) != NULL;
+    literal->decoded = NULL;
+    literal->decoded_length = 0;
+
+    pool->table[slot] = pool->count;
+    return pool->count++;
+}
+
+void intern_string_tokens(StringPool* pool, TokenArray* tokens) {
+    for (int i = 0; i < tokens->count; i++) {
+        Token* token = &tokens->tokens[i];
+        if (token->type == TOKEN_STRING) {
+            token->string_index = intern_string(pool, token->start + 1, token->length - 2);
+        }
+    }
+}
+
+int encode_utf8(uint32_t code, char* out) {
+    if (code < 0x80) {
+        out[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800) {
+        out[0] = (char)(0xC0 | (code >> 6));
+        out[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    if (code < 0x10000) {
+        out[0] = (char)(0xE0 | (code >> 12));
+        out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (code >> 18));
+    out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+// Decodes \n, \t, \r, \0, \", \\ and \u{hex}. Unknown escapes, and \u{}
+// escapes naming a surrogate or a code point past U+10FFFF, are kept
+// verbatim. The output is never longer than the input.
+int decode_escapes(const char* start, int length, char* out) {
+    int written = 0;
+    for (int i = 0; i < length; i++) {
+        if (start[i] != '\\' || i + 1 >= length) {
+            out[written++] = start[i];
+            continue;
+        }
+
+        char c = start[++i];
+        switch (c) {
+            case 'n': out[written++] = '\n'; break;
+            case 't': out[written++] = '\t'; break;
+            case 'r': out[written++] = '\r'; break;
+            case '0': out[written++] = '\0'; break;
+            case '"': out[written++] = '"'; break;
+            case '\\': out[written++] = '\\'; break;
+            case 'u': {
+                int j = i + 1;
+                uint32_t code = 0;
+                if (j < length && start[j] == '{') {
+                    j++;
+                    while (j < length && isxdigit((unsigned char)start[j]) && code <= 0x10FFFF) {
+                        code = code * 16 + (isdigit((unsigned char)start[j]) ? start[j] - '0' : (tolower((unsigned char)start[j]) - 'a' + 10));
+                        j++;
+                    }
+                }
+                bool surrogate = code >= 0xD800 && code <= 0xDFFF;
+                if (j < length && start[j] == '}' && j > i + 2 && code <= 0x10FFFF && !surrogate) {
+                    written += encode_utf8(code, out + written);
+                    i = j;
+                } else {
+                    out[written++] = '\\';
+                    out[written++] = c;
+                }
+                break;
+            }
+            default:
+                out[written++] = '\\';
+                out[written++] = c;
+                break;
+        }
+    }
+    return written;
+}
+
+// Returns the literal's decoded text. Literals without a backslash are
+// returned straight from the source; the rest are decoded on first use.
+// Safe to call from parallel tasks: decoding happens under the pool's lock,
+// and the pool's arena is the context's, which tasks never allocate from.
+const char* string_literal_text(StringPool* pool, int index, int* length) {
+    StringLiteral* literal = &pool->literals[index];
+    if (!literal->has_escapes) {
+        *length = literal->length;
+        return literal->start;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (literal->decoded == NULL) {
+        literal->decoded = allocate(pool->arena, literal->length > 0 ? literal->length : 1);
+        literal->decoded_length = decode_escapes(literal->start, literal->length, literal->decoded);
+    }
+    *length = literal->decoded_length;
+    const char* text = literal->decoded;
+    pthread_mutex_unlock(&pool->lock);
+    return text;
+}
+
+// Parse frame functions
+
+void init_parse_frame_array(ParseFrameArray* array) {
+    array->frames = NULL;
+    array->capacity = 0;
+    array->count = 0;
+}
+
+void free_parse_frame_array(ParseFrameArray* array) {
+    free(array->frames);
+    init_parse_frame_array(array);
+}
+
+void write_parse_frame(ParseFrameArray* array, ParseFrameType type, Stmt* stmt, int base, bool declaration, int64_t start) {
+    if (array->capacity < array->count + 1) {
+        int new_capacity = array->capacity < 8 ? 8 : array->capacity * 2;
+        array->frames = realloc(array->frames, new_capacity * sizeof(ParseFrame));
+        array->capacity = new_capacity;
+    }
+
+    ParseFrame* frame = &array->frames[array->count++];
+    frame->type = type;
+    frame->stmt = stmt;
+    frame->base = base;
+    frame->declaration = declaration;
+    frame->start = start;
+}
+
+// Operator stack functions
+
+void init_operator_array(OperatorArray* array) {
+    array->operators = NULL;
+    array->capacity = 0;
+    array->count = 0;
+}
+
+void free_operator_array(OperatorArray* array) {
+    free(array->operators);
+    init_operator_array(array);
+}
+
+void write_operator(OperatorArray* array, OperatorType type, Token token, Precedence precedence, int base) {
+    if (array->capacity < array->count + 1) {
+        int new_capacity = array->capacity < 8 ? 8 : array->capacity * 2;
+        array->operators = realloc(array->operators, new_capacity * sizeof(Operator));
+        array->capacity = new_capacity;
+    }
+
+    Operator* op = &array->operators[array->count++];
+    op->type = type;
+    op->token = token;
+    op->precedence = precedence;
+    op->base = base;
+}
+
+// Parser functions
+
+Token next_token(Parser* parser) {
+    for (;;) {
+        if (parser->position >= parser->end) {
+            Token eof = parser->tokens[parser->end - 1];
+            eof.type = TOKEN_EOF;
+            eof.start += eof.length;
+            eof.offset += eof.length;
+            eof.length = 0;
+            return eof;
+        }
+
+        Token token = parser->tokens[parser->position++];
+        if (token.type != TOKEN_ERROR) return token;
+
+        error_at(parser, &token, token.error_code, token.start);
+    }
+}
+
+void init_parser(Parser* parser, Arena* arena, StmtArray* scratch, ExprArray* operands, OperatorArray* operators,
+                 ParseFrameArray* frames, Diagnostics* diagnostics, Token* tokens, int start, int end) {
+    parser->arena = arena;
+    parser->scratch = scratch;
+    parser->operands = operands;
+    parser->operators = operators;
+    parser->frames = frames;
+    parser->diagnostics = diagnostics;
+    parser->tokens = tokens;
+    parser->position = start;
+    parser->end = end;
+    parser->had_error = false;
+    parser->panic_mode = false;
+    parser->current = next_token(parser);
+    parser->previous = parser->current;
+}
+
+void advance_token(Parser* parser) {
+    parser->previous = parser->current;
+    parser->current = next_token(parser);
+}
+
+bool match_token(Parser* parser, TokenType type) {
+    if (parser->current.type != type) return false;
+    advance_token(parser);
+    return true;
+}
+
+// Returns the consumed token, or the unexpected one after reporting it.
+Token consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance_token(parser);
+        return parser->previous;
+    }
+
+    error_at(parser, &parser->current, DIAG_SYNTAX, message);
+    return parser->current;
+}
+
+// AST node functions
+
+Expr* new_expr(Parser* parser, ExprType type, Token token) {
+    Expr* expr = allocate(parser->arena, sizeof(Expr));
+    memset(expr, 0, sizeof(Expr));
+    expr->type = type;
+    expr->token = token;
+    return expr;
+}
+
+Stmt* new_stmt(Parser* parser, StmtType type) {
+    Stmt* stmt = allocate(parser->arena, sizeof(Stmt));
+    memset(stmt, 0, sizeof(Stmt));
+    stmt->type = type;
+    return stmt;
+}
+
+// Copies the statements pushed on the scratch stack since `base` into a
+// node-owned array and pops them, so nested blocks share one growable buffer.
+Stmt** take_stmts(Parser* parser, int base, int* count) {
+    *count = parser->scratch->count - base;
+    Stmt** stmts = allocate(parser->arena, (*count > 0 ? *count : 1) * sizeof(Stmt*));
+    // An empty block may be parsed before anything was pushed, while the
+    // scratch array is still NULL.
+    if (*count > 0) memcpy(stmts, parser->scratch->stmts + base, *count * sizeof(Stmt*));
+    parser->scratch->count = base;
+    return stmts;
+}
+
+// Same as take_stmts, for call arguments on the operand stack.
+Expr** take_exprs(Parser* parser, int base, int* count) {
+    *count = parser->operands->count - base;
+    Expr** exprs = allocate(parser->arena, (*count > 0 ? *count : 1) * sizeof(Expr*));
+    if (*count > 0) memcpy(exprs, parser->operands->exprs + base, *count * sizeof(Expr*));
+    parser->operands->count = base;
+    return exprs;
+}
+
+// String literals keep their pool index; the value is only used for numbers
+// and booleans.
+Expr* literal_expr(Parser* parser, Token token, double value) {
+    Expr* expr = new_expr(parser, EXPR_LITERAL, token);
+    expr->value = value;
+    expr->string_index = token.string_index;
+    return expr;
+}
+
+// Lexemes need not be followed by a terminator (streamed tokens are packed
+// back to back), so the digits are copied out before strtod sees them.
+// Lexemes too long for the stack buffer are copied to the heap instead of
+// being cut short.
+double number_value(Token* token) {
+    char buffer[64];
+    char* digits = buffer;
+    if (token->length >= (int)sizeof(buffer)) digits = malloc(token->length + 1);
+    memcpy(digits, token->start, token->length);
+    digits[token->length] = '\0';
+    double value = strtod(digits, NULL);
+    if (digits != buffer) free(digits);
+    return value;
+}
+
+Expr* binary_expr(Parser* parser, Expr* left, Token op, Expr* right) {
+    Expr* expr = new_expr(parser, EXPR_BINARY, op);
+    expr->left = left;
+    expr->right = right;
+    return expr;
+}
+
+Expr* logical_expr(Parser* parser, Expr* left, Token op, Expr* right) {
+    Expr* expr = new_expr(parser, EXPR_LOGICAL, op);
+    expr->left = left;
+    expr->right = right;
+    return expr;
+}
+
+Expr* unary_expr(Parser* parser, Token op, Expr* right) {
+    Expr* expr = new_expr(parser, EXPR_UNARY, op);
+    expr->right = right;
+    return expr;
+}
+
+Expr* grouping_expr(Parser* parser, Token paren, Expr* inner) {
+    Expr* expr = new_expr(parser, EXPR_GROUPING, paren);
+    expr->expr = inner;
+    return expr;
+}
+
+Expr* variable_expr(Parser* parser, Token name) {
+    Expr* expr = new_expr(parser, EXPR_VARIABLE, name);
+    expr->name = name.start;
+    return expr;
+}
+
+Expr* assign_expr(Parser* parser, Token name, Expr* value) {
+    Expr* expr = new_expr(parser, EXPR_ASSIGN, name);
+    expr->name = name.start;
+    expr->right = value;
+    return expr;
+}
+
+Expr* call_expr(Parser* parser, Expr* callee, Token paren, int args_base) {
+    Expr* expr = new_expr(parser, EXPR_CALL, paren);
+    expr->callee = callee;
+    expr->args = take_exprs(parser, args_base, &expr->arg_count);
+    return expr;
+}
+
+Stmt* expr_stmt(Parser* parser, Expr* expr) {
+    Stmt* stmt = new_stmt(parser, STMT_EXPR);
+    stmt->expr = expr;
+    return stmt;
+}
+
+Stmt* var_stmt(Parser* parser, Token name, Expr* initializer) {
+    Stmt* stmt = new_stmt(parser, STMT_VAR);
+    stmt->var_decl.name = name;
+    stmt->var_decl.initializer = initializer;
+    return stmt;
+}
+
+Stmt* block_stmt(Parser* parser, int base) {
+    Stmt* stmt = new_stmt(parser, STMT_BLOCK);
+    stmt->stmts = take_stmts(parser, base, &stmt->stmt_count);
+    return stmt;
+}
+
+Stmt* if_stmt(Parser* parser, Expr* condition, Stmt* then_branch, Stmt* else_branch) {
+    Stmt* stmt = new_stmt(parser, STMT_IF);
+    stmt->expr = condition;
+    stmt->then_branch = then_branch;
+    stmt->else_branch = else_branch;
+    return stmt;
+}
+
+Stmt* while_stmt(Parser* parser, Expr* condition, Stmt* body) {
+    Stmt* stmt = new_stmt(parser, STMT_WHILE);
+    stmt->expr = condition;
+    stmt->stmts = allocate(parser->arena, sizeof(Stmt*));
+    stmt->stmts[0] = body;
+    stmt->stmt_count = 1;
+    return stmt;
+}
+
+// The body is filled in once its statements have been parsed.
+Stmt* func_stmt(Parser* parser, Token name, Token* params, int param_count) {
+    Stmt* stmt = new_stmt(parser, STMT_FUNC);
+    stmt->name = name;
+    stmt->param_count = param_count;
+    stmt->params = allocate(parser->arena, (param_count > 0 ? param_count : 1) * sizeof(Token));
+    memcpy(stmt->params, params, param_count * sizeof(Token));
+    return stmt;
+}
+
+Stmt* return_stmt(Parser* parser, Token keyword, Expr* value) {
+    Stmt* stmt = new_stmt(parser, STMT_RETURN);
+    stmt->name = keyword;
+    stmt->expr = value;
+    return stmt;
+}
+
+Precedence infix_precedence(TokenType type) {
+    switch (type) {
+        case TOKEN_EQUAL:
+            return PREC_ASSIGNMENT;
+        case TOKEN_OR:
+            return PREC_OR;
+        case TOKEN_AND:
+            return PREC_AND;
+        case TOKEN_EQUAL_EQUAL:
+        case TOKEN_BANG_EQUAL:
+            return PREC_EQUALITY;
+        case TOKEN_LESS:
+        case TOKEN_LESS_EQUAL:
+        case TOKEN_GREATER:
+        case TOKEN_GREATER_EQUAL:
+            return PREC_COMPARISON;
+        case TOKEN_PLUS:
+        case TOKEN_MINUS:
+            return PREC_TERM;
+        case TOKEN_STAR:
+        case TOKEN_SLASH:
+            return PREC_FACTOR;
+        default:
+            return PREC_NONE;
+    }
+}
+
+Expr* pop_operand(Parser* parser) {
+    return parser->operands->exprs[--parser->operands->count];
+}
+
+// Applies the operator on top of the operator stack to the operands on top
+// of the operand stack.
+void reduce_operator(Parser* parser) {
+    Operator op = parser->operators->operators[--parser->operators->count];
+    Expr* right = pop_operand(parser);
+
+    switch (op.type) {
+        case OPERATOR_PREFIX:
+            write_expr(parser->operands, unary_expr(parser, op.token, right));
+            break;
+        case OPERATOR_ASSIGN:
+            write_expr(parser->operands, assign_expr(parser, op.token, right));
+            break;
+        case OPERATOR_INFIX: {
+            Expr* left = pop_operand(parser);
+            if (op.token.type == TOKEN_AND || op.token.type == TOKEN_OR) {
+                write_expr(parser->operands, logical_expr(parser, left, op.token, right));
+            } else {
+                write_expr(parser->operands, binary_expr(parser, left, op.token, right));
+            }
+            break;
+        }
+        case OPERATOR_GROUP:
+        case OPERATOR_CALL:
+            // Open parentheses have PREC_NONE and are closed by close_paren.
+            break;
+    }
+}
+
+// Reduces the pending operators above `base` that bind at least as tightly
+// as `precedence`. An open parenthesis stops it.
+void reduce_operators(Parser* parser, int base, Precedence precedence) {
+    OperatorArray* operators = parser->operators;
+    while (operators->count > base && operators->operators[operators->count - 1].precedence >= precedence) {
+        reduce_operator(parser);
+    }
+}
+
+// Closes the innermost open grouping or call, whose contents have already
+// been reduced. A missing ')' is reported and the node is built anyway.
+void close_paren(Parser* parser) {
+    Operator open = parser->operators->operators[--parser->operators->count];
+
+    if (open.type == OPERATOR_GROUP) {
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+        Expr* inner = pop_operand(parser);
+        write_expr(parser->operands, grouping_expr(parser, open.token, inner));
+        return;
+    }
+
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    Expr* callee = parser->operands->exprs[open.base];
+    parser->operands->exprs[open.base] = call_expr(parser, callee, parser->previous, open.base + 1);
+}
+
+// Reads what may follow an operand: calls, closing parentheses and argument
+// commas. Returns true once a binary operator or a ',' has been read and
+// another operand is needed, or false where the expression ends.
+bool parse_infix(Parser* parser, int base) {
+    ExprArray* operands = parser->operands;
+    OperatorArray* operators = parser->operators;
+
+    for (;;) {
+        Token token = parser->current;
+
+        if (token.type == TOKEN_LEFT_PAREN) {
+            advance_token(parser);
+            write_operator(operators, OPERATOR_CALL, token, PREC_NONE, operands->count - 1);
+            if (parser->current.type != TOKEN_RIGHT_PAREN) return true;
+            close_paren(parser);
+            continue;
+        }
+
+        Precedence precedence = infix_precedence(token.type);
+        if (precedence == PREC_ASSIGNMENT) {
+            // Assignment is right-associative, so earlier '='s stay pending.
+            advance_token(parser);
+            reduce_operators(parser, base, PREC_OR);
+            Expr* target = pop_operand(parser);
+            if (target != NULL && target->type == EXPR_VARIABLE) {
+                write_operator(operators, OPERATOR_ASSIGN, target->token, PREC_ASSIGNMENT, 0);
+            } else {
+                error_at(parser, &token, DIAG_INVALID_ASSIGNMENT, "Invalid assignment target.");
+            }
+            return true;
+        }
+
+        if (precedence != PREC_NONE) {
+            advance_token(parser);
+            reduce_operators(parser, base, precedence);
+            write_operator(operators, OPERATOR_INFIX, token, precedence, 0);
+            return true;
+        }
+
+        // Anything else ends the operand of the innermost open parenthesis,
+        // or the whole expression if none is open.
+        reduce_operators(parser, base, PREC_ASSIGNMENT);
+        if (operators->count == base) return false;
+
+        Operator* open = &operators->operators[operators->count - 1];
+        if (open->type == OPERATOR_CALL) {
+            if (operands->count - open->base - 1 > 255) {
+                error_at(parser, &parser->current, DIAG_TOO_MANY_ARGUMENTS, "Can't have more than 255 arguments.");
+                operands->count--;
+            }
+            if (match_token(parser, TOKEN_COMMA)) return true;
+        }
+        close_paren(parser);
+    }
+}
+
+// Precedence climbing over two explicit stacks, operands on
+// parser->operands and pending operators on parser->operators, so nested
+// groupings, calls and operator chains are bounded by memory rather than
+// the C stack. A '(' in operand position opens a grouping and one after an
+// operand opens a call; both sit on the operator stack until their ')'.
+Expr* parse_expression(Parser* parser) {
+    int operand_base = parser->operands->count;
+    int operator_base = parser->operators->count;
+
+    do {
+        for (;;) {
+            TokenType type = parser->current.type;
+            if (type == TOKEN_BANG || type == TOKEN_MINUS) {
+                write_operator(parser->operators, OPERATOR_PREFIX, parser->current, PREC_UNARY, 0);
+            } else if (type == TOKEN_LEFT_PAREN) {
+                write_operator(parser->operators, OPERATOR_GROUP, parser->current, PREC_NONE, 0);
+            } else {
+                break;
+            }
+            advance_token(parser);
+        }
+
+        write_expr(parser->operands, parse_primary(parser));
+    } while (parse_infix(parser, operator_base));
+
+    Expr* expr = pop_operand(parser);
+    parser->operands->count = operand_base;
+    return expr;
+}
+
+Expr* parse_primary(Parser* parser) {
+    switch (parser->current.type) {
+        case TOKEN_FALSE:
+            advance_token(parser);
+            return literal_expr(parser, parser->previous, false);
+        case TOKEN_TRUE:
+            advance_token(parser);
+            return literal_expr(parser, parser->previous, true);
+        case TOKEN_NIL:
+            advance_token(parser);
+            return literal_expr(parser, parser->previous, 0);
+        case TOKEN_NUMBER:
+            advance_token(parser);
+            return literal_expr(parser, parser->previous, number_value(&parser->previous));
+        case TOKEN_STRING:
+            advance_token(parser);
+            return literal_expr(parser, parser->previous, 0);
+        case TOKEN_IDENTIFIER:
+            advance_token(parser);
+            return variable_expr(parser, parser->previous);
+        default:
+            // The offending token is consumed so that synchronize, which
+            // stops right after a ';', always moves past it.
+            error_at(parser, &parser->current, DIAG_EXPECTED_EXPRESSION, "Expect expression.");
+            if (parser->current.type != TOKEN_EOF) advance_token(parser);
+            return NULL;
+    }
+}
+
+// Skips tokens until the next statement boundary so one mistake yields one
+// diagnostic and parsing resumes with the following statement.
+void synchronize(Parser* parser) {
+    parser->panic_mode = false;
+
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON) return;
+
+        switch (parser->current.type) {
+            case TOKEN_CLASS:
+            case TOKEN_FUNC:
+            case TOKEN_VAR:
+            case TOKEN_LET:
+            case TOKEN_FOR:
+            case TOKEN_IF:
+            case TOKEN_WHILE:
+            case TOKEN_RETURN:
+                return;
+            default:
+                break;
+        }
+
+        advance_token(parser);
+    }
+}
+
+Stmt* parse_var_declaration(Parser* parser) {
+    Token name = consume(parser, TOKEN_IDENTIFIER, "Expect variable name.");
+
+    Expr* initializer = NULL;
+    if (match_token(parser, TOKEN_EQUAL)) {
+        initializer = parse_expression(parser);
+    }
+
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    return var_stmt(parser, name, initializer);
+}
+
+Stmt* parse_expr_statement(Parser* parser) {
+    Expr* expr = parse_expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    return expr_stmt(parser, expr);
+}
+
+Stmt* parse_return_statement(Parser* parser) {
+    Token keyword = parser->previous;
+    Expr* value = NULL;
+
+    if (parser->current.type != TOKEN_SEMICOLON) {
+        value = parse_expression(parser);
+    }
+
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    return return_stmt(parser, keyword, value);
+}
+
+Stmt* begin_if_statement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    Expr* condition = parse_expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after if condition.");
+    return if_stmt(parser, condition, NULL, NULL);
+}
+
+Stmt* begin_while_statement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    Expr* condition = parse_expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after while condition.");
+    return while_stmt(parser, condition, NULL);
+}
+
+Stmt* begin_func_declaration(Parser* parser) {
+    Token name = consume(parser, TOKEN_IDENTIFIER, "Expect function name.");
+
+    int64_t start = consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.").offset;
+    Token params[255];
+    int param_count = 0;
+
+    if (parser->current.type != TOKEN_RIGHT_PAREN) {
+        do {
+            Token param = consume(parser, TOKEN_IDENTIFIER, "Expect parameter name.");
+            if (param_count >= 255) {
+                error_at(parser, &parser->current, DIAG_TOO_MANY_PARAMETERS, "Can't have more than 255 parameters.");
+            } else {
+                params[param_count++] = param;
+            }
+        } while (match_token(parser, TOKEN_COMMA));
+    }
+
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    Stmt* stmt = func_stmt(parser, name, params, param_count);
+    stmt->start = start;
+    return stmt;
+}
+
+// Parses a statement that has no nested statements and returns it. Blocks,
+// ifs, whiles and functions only have their header parsed here: they are
+// pushed as a frame and NULL is returned.
+Stmt* begin_statement(Parser* parser, bool declaration) {
+    if (declaration && match_token(parser, TOKEN_VAR)) {
+        return parse_var_declaration(parser);
+    }
+
+    if (match_token(parser, TOKEN_LEFT_BRACE)) {
+        write_parse_frame(parser->frames, FRAME_BLOCK, NULL, parser->scratch->count, declaration, parser->previous.offset);
+    } else if (match_token(parser, TOKEN_IF)) {
+        write_parse_frame(parser->frames, FRAME_IF, begin_if_statement(parser), 0, declaration, 0);
+    } else if (match_token(parser, TOKEN_WHILE)) {
+        write_parse_frame(parser->frames, FRAME_WHILE, begin_while_statement(parser), 0, declaration, 0);
+    } else if (match_token(parser, TOKEN_FUNC)) {
+        Stmt* stmt = begin_func_declaration(parser);
+        write_parse_frame(parser->frames, FRAME_FUNC, stmt, parser->scratch->count, declaration, stmt->start);
+    } else if (match_token(parser, TOKEN_RETURN)) {
+        return parse_return_statement(parser);
+    } else {
+        return parse_expr_statement(parser);
+    }
+
+    return NULL;
+}
+
+// Hands the frame its finished child (NULL right after the frame is pushed).
+// Returns true when the frame needs another child, setting `declaration` to
+// whether that child may be a declaration; otherwise the frame is complete
+// and frame->stmt holds the statement.
+bool resume_frame(Parser* parser, ParseFrame* frame, Stmt* child, bool* declaration) {
+    switch (frame->type) {
+        case FRAME_BLOCK:
+        case FRAME_FUNC:
+            if (child != NULL) write_stmt(parser->scratch, child);
+
+            if (parser->current.type != TOKEN_RIGHT_BRACE && parser->current.type != TOKEN_EOF) {
+                *declaration = true;
+                return true;
+            }
+
+            if (frame->type == FRAME_BLOCK) {
+                consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+                frame->stmt = block_stmt(parser, frame->base);
+            } else {
+                consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after function body.");
+                frame->stmt->body = take_stmts(parser, frame->base, &frame->stmt->stmt_count);
+            }
+            // A missing '}' ends the scope at the last token consumed.
+            frame->stmt->start = frame->start;
+            frame->stmt->end = parser->previous.offset + parser->previous.length;
+            return false;
+        case FRAME_IF:
+            *declaration = false;
+            if (child == NULL) return true;
+
+            if (frame->stmt->then_branch == NULL) {
+                frame->stmt->then_branch = child;
+                return match_token(parser, TOKEN_ELSE);
+            }
+
+            frame->stmt->else_branch = child;
+            return false;
+        case FRAME_WHILE:
+            *declaration = false;
+            if (child == NULL) return true;
+
+            frame->stmt->stmts[0] = child;
+            return false;
+    }
+
+    return false;
+}
+
+// Statements nest through parser->frames rather than the C stack, so the
+// depth of nested blocks is bounded only by memory.
+Stmt* parse_declaration(Parser* parser) {
+    int base = parser->frames->count;
+    bool declaration = true;
+
+    for (;;) {
+        Stmt* stmt = begin_statement(parser, declaration);
+
+        // Feed each finished statement to the frame waiting for it, popping
+        // frames as they complete, until one asks for another child.
+        for (;;) {
+            if (stmt != NULL && declaration && parser->panic_mode) synchronize(parser);
+            if (parser->frames->count == base) return stmt;
+
+            ParseFrame* frame = &parser->frames->frames[parser->frames->count - 1];
+            if (resume_frame(parser, frame, stmt, &declaration)) break;
+
+            stmt = frame->stmt;
+            declaration = frame->declaration;
+            parser->frames->count--;
+        }
+    }
+}
+
+// Work array functions
+
+void init_work_array(WorkArray* array) {
+    array->items = NULL;
+    array->capacity = 0;
+    array->count = 0;
+}
+
+void free_work_array(WorkArray* array) {
+    free(array->items);
+    init_work_array(array);
+}
+
+void write_work(WorkArray* array, WorkType type, Stmt* stmt, Expr* expr, FunctionState* function) {
+    if (array->capacity < array->count + 1) {
+        int new_capacity = array->capacity < 8 ? 8 : array->capacity * 2;
+        array->items = realloc(array->items, new_capacity * sizeof(WorkItem));
+        array->capacity = new_capacity;
+    }
+
+    WorkItem* item = &array->items[array->count++];
+    item->type = type;
+    item->stmt = stmt;
+    item->expr = expr;
+    item->function = function;
+}
+
+// Semantic analyzer functions
+//
+// The resolver walks the tree with an explicit stack in analyzer->work:
+// children are pushed in reverse so they pop in source order, and the
+// bookkeeping a recursive walk does on the way back out (defining a
+// variable, closing a scope or a function) is pushed as its own item.
+
+void push_stmt(Analyzer* analyzer, Stmt* stmt) {
+    write_work(&analyzer->work, WORK_STMT, stmt, NULL, NULL);
+}
+
+// Parse errors leave NULL where an expression was expected; the tree is
+// still resolved when it is being indexed, so those holes are skipped.
+void push_expr(Analyzer* analyzer, Expr* expr) {
+    if (expr == NULL) return;
+    write_work(&analyzer->work, WORK_EXPR, NULL, expr, NULL);
+}
+
+// Functions are defined as soon as they are declared so their bodies can
+// refer to them, and remember their declaration for the reachability pass.
+void declare_function(Analyzer* analyzer, Stmt* stmt) {
+    stmt->is_captured = false;
+    declare_variable(analyzer, &stmt->name, SYMBOL_FUNCTION, false, &stmt->is_captured, &stmt->binding_type);
+    define_variable(analyzer, &stmt->name);
+    analyzer->current->variables.variables[analyzer->current->variables.count - 1].function = stmt;
+}
+
+// Opens the function's scope and parameters and queues its body. The
+// FunctionState lives in the arena because it must outlast this call.
+void begin_function(Stmt* stmt, Analyzer* analyzer) {
+    FunctionState* function = allocate(analyzer->arena, sizeof(FunctionState));
+    function->enclosing = analyzer->function;
+    function->decl = stmt;
+    function->local_count = 0;
+    analyzer->function = function;
+
+    stmt->enclosing = function->enclosing != NULL ? function->enclosing->decl : NULL;
+    stmt->upvalues = NULL;
+    stmt->upvalue_count = 0;
+    stmt->upvalue_capacity = 0;
+    stmt->captured_params = allocate(analyzer->arena, (stmt->param_count > 0 ? stmt->param_count : 1) * sizeof(bool));
+    stmt->param_types = allocate(analyzer->arena, (stmt->param_count > 0 ? stmt->param_count : 1) * sizeof(ValueType));
+
+    begin_scope(analyzer, stmt);
+    for (int i = 0; i < stmt->param_count; i++) {
+        stmt->captured_params[i] = false;
+        stmt->param_types[i] = TYPE_UNKNOWN;
+        declare_variable(analyzer, &stmt->params[i], SYMBOL_PARAMETER, false, &stmt->captured_params[i], &stmt->param_types[i]);
+        define_variable(analyzer, &stmt->params[i]);
+    }
+
+    write_work(&analyzer->work, WORK_END_FUNCTION, stmt, NULL, function);
+    for (int i = stmt->stmt_count - 1; i >= 0; i--) {
+        push_stmt(analyzer, stmt->body[i]);
+    }
+}
+
+void visit_stmt(Stmt* stmt, Analyzer* analyzer) {
+    switch (stmt->type) {
+        case STMT_EXPR:
+            push_expr(analyzer, stmt->expr);
+            break;
+        case STMT_VAR:
+            stmt->var_decl.is_captured = false;
+            declare_variable(analyzer, &stmt->var_decl.name, SYMBOL_VARIABLE, false, &stmt->var_decl.is_captured,
+                             &stmt->var_decl.type);
+            write_work(&analyzer->work, WORK_DEFINE, stmt, NULL, NULL);
+            if (stmt->var_decl.initializer != NULL) {
+                push_expr(analyzer, stmt->var_decl.initializer);
+            }
+            break;
+        case STMT_BLOCK:
+            begin_scope(analyzer, stmt);
+            write_work(&analyzer->work, WORK_END_SCOPE, stmt, NULL, NULL);
+            for (int i = stmt->stmt_count - 1; i >= 0; i--) {
+                push_stmt(analyzer, stmt->stmts[i]);
+            }
+            break;
+        case STMT_IF:
+            if (stmt->else_branch != NULL) {
+                push_stmt(analyzer, stmt->else_branch);
+            }
+            push_stmt(analyzer, stmt->then_branch);
+            push_expr(analyzer, stmt->expr);
+            break;
+        case STMT_WHILE:
+            push_stmt(analyzer, stmt->stmts[0]);
+            push_expr(analyzer, stmt->expr);
+            break;
+        case STMT_FUNC:
+            declare_function(analyzer, stmt);
+            begin_function(stmt, analyzer);
+            break;
+        case STMT_RETURN:
+            if (stmt->expr != NULL) {
+                push_expr(analyzer, stmt->expr);
+            }
+            break;
+    }
+}
+
+void visit_expr(Expr* expr, Analyzer* analyzer) {
+    switch (expr->type) {
+        case EXPR_BINARY:
+        case EXPR_LOGICAL:
+            push_expr(analyzer, expr->right);
+            push_expr(analyzer, expr->left);
+            break;
+        case EXPR_UNARY:
+            push_expr(analyzer, expr->right);
+            break;
+        case EXPR_LITERAL:
+            break;
+        case EXPR_GROUPING:
+            push_expr(analyzer, expr->expr);
+            break;
+        case EXPR_VARIABLE:
+            if (analyzer->current->enclosing != NULL) {
+                int i = find_variable(analyzer->current, &expr->token);
+                if (i != -1 && analyzer->current->variables.variables[i].depth == -1) {
+                    analyzer_error(analyzer, &expr->token, DIAG_SELF_INITIALIZER, "Cannot read local variable in its own initializer.");
+                }
+            }
+            resolve_local(analyzer, expr, &expr->token);
+            break;
+        case EXPR_ASSIGN:
+            write_work(&analyzer->work, WORK_ASSIGN, NULL, expr, NULL);
+            push_expr(analyzer, expr->right);
+            break;
+        case EXPR_CALL:
+            for (int i = expr->arg_count - 1; i >= 0; i--) {
+                push_expr(analyzer, expr->args[i]);
+            }
+            push_expr(analyzer, expr->callee);
+            break;
+    }
+}
+
+// Processes work items until the stack is back down to `base`.
+void run_resolver(Analyzer* analyzer, int base) {
+    while (analyzer->work.count > base) {
+        WorkItem item = analyzer->work.items[--analyzer->work.count];
+
+        switch (item.type) {
+            case WORK_STMT:
+                visit_stmt(item.stmt, analyzer);
+                break;
+            case WORK_EXPR:
+                visit_expr(item.expr, analyzer);
+                break;
+            case WORK_DEFINE:
+                define_variable(analyzer, &item.stmt->var_decl.name);
+                break;
+            case WORK_ASSIGN:
+                resolve_local(analyzer, item.expr, &item.expr->token);
+                break;
+            case WORK_END_SCOPE:
+                end_scope(analyzer);
+                break;
+            case WORK_END_FUNCTION:
+                end_scope(analyzer);
+                analyzer->function = item.function->enclosing;
+                break;
+        }
+    }
+}
+
+void resolve_stmt(Stmt* stmt, Analyzer* analyzer) {
+    int base = analyzer->work.count;
+    push_stmt(analyzer, stmt);
+    run_resolver(analyzer, base);
+}
+
+void resolve_expr(Expr* expr, Analyzer* analyzer) {
+    int base = analyzer->work.count;
+    push_expr(analyzer, expr);
+    run_resolver(analyzer, base);
+}
+
+void resolve_function(Stmt* stmt, Analyzer* analyzer) {
+    int base = analyzer->work.count;
+    begin_function(stmt, analyzer);
+    run_resolver(analyzer, base);
+}
+
+// Variable array functions
+
+void init_variable_array(VariableArray* array) {
+    array->variables = NULL;
+    array->capacity = 0;
+    array->count = 0;
+}
+
+void free_variable_array(VariableArray* array) {
+    free(array->variables);
+    init_variable_array(array);
+}
+
+void write_variable(VariableArray* array, Token* name, bool is_const) {
+    if (array->capacity < array->count + 1) {
+        int new_capacity = array->capacity < 8 ? 8 : array->capacity * 2;
+        array->variables = realloc(array->variables, new_capacity * sizeof(Variable));
+        array->capacity = new_capacity;
+    }
+
+    array->variables[array->count].name = name->start;
+    array->variables[array->count].length = name->length;
+    array->variables[array->count].depth = -1;
+    array->variables[array->count].slot = -1;
+    array->variables[array->count].is_const = is_const;
+    array->variables[array->count].captured = NULL;
+    array->variables[array->count].type = NULL;
+    array->variables[array->count].declaration = -1;
+    array->variables[array->count].function = NULL;
+    array->count++;
+}
+
+bool identifiers_equal(Token* name, Variable* variable) {
+    return name->length == variable->length && memcmp(name->start, variable->name, name->length) == 0;
+}
+
+// Returns the table slot holding the global named `name`, or the empty slot
+// where it would go.
+uint32_t find_global_slot(Scope* scope, Token* name) {
+    uint32_t mask = scope->table_capacity - 1;
+    uint32_t slot = hash_string(name->start, name->length) & mask;
+    while (scope->table[slot] != -1 && !identifiers_equal(name, &scope->variables.variables[scope->table[slot]])) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void grow_global_table(Scope* scope) {
+    int new_capacity = scope->table_capacity < 16 ? 16 : scope->table_capacity * 2;
+    free(scope->table);
+    scope->table = malloc(new_capacity * sizeof(int));
+    scope->table_capacity = new_capacity;
+    for (int i = 0; i < new_capacity; i++) scope->table[i] = -1;
+
+    for (int i = 0; i < scope->variables.count - 1; i++) {
+        Variable* variable = &scope->variables.variables[i];
+        Token name;
+        name.start = variable->name;
+        name.length = variable->length;
+        scope->table[find_global_slot(scope, &name)] = i;
+    }
+}
+
+// Points the global's name at variable `index`, the newest declaration.
+void index_global(Scope* scope, Token* name, int index) {
+    if ((scope->variables.count + 1) * 4 > scope->table_capacity * 3) grow_global_table(scope);
+    scope->table[find_global_slot(scope, name)] = index;
+}
+
+void clear_global_scope(Scope* scope) {
+    scope->variables.count = 0;
+    for (int i = 0; i < scope->table_capacity; i++) scope->table[i] = -1;
+}
+
+int find_variable(Scope* scope, Token* name) {
+    if (scope->enclosing == NULL) {
+        return scope->table_capacity > 0 ? scope->table[find_global_slot(scope, name)] : -1;
+    }
+
+    for (int i = scope->variables.count - 1; i >= 0; i--) {
+        if (identifiers_equal(name, &scope->variables.variables[i])) return i;
+    }
+    return -1;
+}
+
+int add_upvalue(Arena* arena, Stmt* decl, Token* name, int index, bool is_local) {
+    for (int i = 0; i < decl->upvalue_count; i++) {
+        Upvalue* upvalue = &decl->upvalues[i];
+        if (upvalue->index == index && upvalue->is_local == is_local) return i;
+    }
+
+    if (decl->upvalue_capacity < decl->upvalue_count + 1) {
+        int new_capacity = decl->upvalue_capacity < 8 ? 8 : decl->upvalue_capacity * 2;
+        decl->upvalues = reallocate(arena, decl->upvalues, decl->upvalue_capacity * sizeof(Upvalue),
+                                    new_capacity * sizeof(Upvalue));
+        decl->upvalue_capacity = new_capacity;
+    }
+    decl->upvalues[decl->upvalue_count].name = *name;
+    decl->upvalues[decl->upvalue_count].index = index;
+    decl->upvalues[decl->upvalue_count].is_local = is_local;
+    return decl->upvalue_count++;
+}
+
+// Threads the capture through every function between the reference and the
+// function that owns the variable, so each one records what it must close
+// over. Returns the upvalue index in `function`.
+int resolve_upvalue(Arena* arena, Stmt* function, Stmt* owner, Token* name, int slot) {
+    if (function->enclosing == owner) {
+        return add_upvalue(arena, function, name, slot, true);
+    }
+
+    int index = resolve_upvalue(arena, function->enclosing, owner, name, slot);
+    return add_upvalue(arena, function, name, index, false);
+}
+
+// Looks the name up through every enclosing scope. Globals (the outermost
+// scope) are never captured; a local owned by another function is marked
+// captured and becomes an upvalue of each function in between.
+bool resolve_local(Analyzer* analyzer, Expr* expr, Token* name) {
+    int depth = 0;
+    for (Scope* scope = analyzer->current; scope != NULL; scope = scope->enclosing, depth++) {
+        int i = find_variable(scope, name);
+        if (i == -1) continue;
+
+        Variable* variable = &scope->variables.variables[i];
+        if (analyzer->index != NULL && variable->declaration != -1) {
+            record_reference(analyzer->index, name, variable->declaration);
+        }
+
+        expr->variable.depth = depth;
+        expr->variable.index = variable->slot;
+        expr->variable.is_captured = false;
+        expr->variable.function = variable->function;
+        expr->variable.type = variable->type;
+        expr->variable.slot = variable->slot;
+        expr->variable.owner = scope->function != NULL ? scope->function->decl : NULL;
+        expr->variable.captured = variable->captured;
+
+        if (scope->enclosing != NULL && scope->function != analyzer->function) {
+            if (variable->captured != NULL) *variable->captured = true;
+            expr->variable.index = resolve_upvalue(analyzer->arena, analyzer->function->decl, expr->variable.owner, name,
+                                                   variable->slot);
+            expr->variable.is_captured = true;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+void declare_variable(Analyzer* analyzer, Token* name, SymbolKind kind, bool is_const, bool* captured, ValueType* type) {
+    if (find_variable(analyzer->current, name) != -1) {
+        analyzer_error(analyzer, name, DIAG_DUPLICATE_DECLARATION, "Variable with this name already declared in this scope.");
+    }
+
+    write_variable(&analyzer->current->variables, name, is_const);
+    if (analyzer->current->enclosing == NULL) {
+        index_global(analyzer->current, name, analyzer->current->variables.count - 1);
+    }
+
+    Variable* variable = &analyzer->current->variables.variables[analyzer->current->variables.count - 1];
+    variable->captured = captured;
+    variable->type = type;
+    if (analyzer->index != NULL) {
+        variable->declaration = record_declaration(analyzer->index, name, kind, analyzer->current->index_scope);
+    }
+    if (analyzer->current->enclosing != NULL) {
+        variable->slot = analyzer->function != NULL ? analyzer->function->local_count++ : analyzer->script_local_count++;
+    }
+}
+
+void define_variable(Analyzer* analyzer, Token* name) {
+    if (analyzer->current->variables.count == 0) return;
+    analyzer->current->variables.variables[analyzer->current->variables.count - 1].depth = 0;
+}
+
+// Statement array functions
+
+void init_stmt_array(StmtArray* array) {
+    array->stmts = NULL;
+    array->capacity = 0;
+    array->count = 0;
+}
+
+void free_stmt_array(StmtArray* array) {
+    free(array->stmts);
+    init_stmt_array(array);
+}
+
+void write_stmt(StmtArray* array, Stmt* stmt) {
+    if (array->capacity < array->count + 1) {
+        int new_capacity = array->capacity < 8 ? 8 : array->capacity * 2;
+        array->stmts = realloc(array->stmts, new_capacity * sizeof(Stmt*));
+        array->capacity = new_capacity;
+    }
+
+    array->stmts[array->count++] = stmt;
+}
+
+// Expression array functions
+
+void init_expr_array(ExprArray* array) {
+    array->exprs = NULL;
+    array->capacity = 0;
+    array->count = 0;
+}
+
+void free_expr_array(ExprArray* array) {
+    free(array->exprs);
+    init_expr_array(array);
+}
+
+void write_expr(ExprArray* array, Expr* expr) {
+    if (array->capacity < array->count + 1) {
+        int new_capacity = array->capacity < 8 ? 8 : array->capacity * 2;
+        array->exprs = realloc(array->exprs, new_capacity * sizeof(Expr*));
+        array->capacity = new_capacity;
+    }
+
+    array->exprs[array->count++] = expr;
+}
+
+// Symbol index functions
+
+void init_symbol_index(SymbolIndex* index) {
+    index->declarations = NULL;
+    index->declaration_capacity = 0;
+    index->declaration_count = 0;
+    index->references = NULL;
+    index->reference_capacity = 0;
+    index->reference_count = 0;
+    index->scopes = NULL;
+    index->scope_capacity = 0;
+    index->scope_count = 0;
+    index->intervals = NULL;
+    index->interval_capacity = 0;
+    index->interval_count = 0;
+}
+
+void free_symbol_index(SymbolIndex* index) {
+    free(index->declarations);
+    free(index->references);
+    free(index->scopes);
+    free(index->intervals);
+    init_symbol_index(index);
+}
+
+// Scope 0 is the file's global scope and covers every offset.
+void reset_symbol_index(SymbolIndex* index) {
+    index->declaration_count = 0;
+    index->reference_count = 0;
+    index->scope_count = 0;
+    index->interval_count = 0;
+    record_scope(index, 0, INT64_MAX);
+}
+
+// Scopes nest, so the scopes whose range covers an offset are exactly the
+// ones enclosing it.
+int record_scope(SymbolIndex* index, int64_t start, int64_t end) {
+    if (index->scope_capacity < index->scope_count + 1) {
+        int new_capacity = index->scope_capacity < 8 ? 8 : index->scope_capacity * 2;
+        index->scopes = realloc(index->scopes, new_capacity * sizeof(ScopeRange));
+        index->scope_capacity = new_capacity;
+    }
+
+    ScopeRange* range = &index->scopes[index->scope_count];
+    range->start = start;
+    range->end = end;
+    return index->scope_count++;
+}
+
+int record_declaration(SymbolIndex* index, Token* name, SymbolKind kind, int scope) {
+    if (index->declaration_capacity < index->declaration_count + 1) {
+        int new_capacity = index->declaration_capacity < 8 ? 8 : index->declaration_capacity * 2;
+        index->declarations = realloc(index->declarations, new_capacity * sizeof(Declaration));
+        index->declaration_capacity = new_capacity;
+    }
+
+    Declaration* declaration = &index->declarations[index->declaration_count];
+    declaration->kind = kind;
+    declaration->offset = name->offset;
+    declaration->length = name->length;
+    declaration->scope = scope;
+    return index->declaration_count++;
+}
+
+void record_reference(SymbolIndex* index, Token* name, int declaration) {
+    if (index->reference_capacity < index->reference_count + 1) {
+        int new_capacity = index->reference_capacity < 8 ? 8 : index->reference_capacity * 2;
+        index->references = realloc(index->references, new_capacity * sizeof(Reference));
+        index->reference_capacity = new_capacity;
+    }
+
+    Reference* reference = &index->references[index->reference_count++];
+    reference->offset = name->offset;
+    reference->length = name->length;
+    reference->declaration = declaration;
+}
+
+void write_interval(SymbolIndex* index, int64_t start, int length, int declaration) {
+    if (index->interval_capacity < index->interval_count + 1) {
+        int new_capacity = index->interval_capacity < 8 ? 8 : index->interval_capacity * 2;
+        index->intervals = realloc(index->intervals, new_capacity * sizeof(Interval));
+        index->interval_capacity = new_capacity;
+    }
+
+    Interval* interval = &index->intervals[index->interval_count++];
+    interval->start = start;
+    interval->length = length;
+    interval->declaration = declaration;
+}
+
+int compare_intervals(const void* a, const void* b) {
+    int64_t left = ((const Interval*)a)->start;
+    int64_t right = ((const Interval*)b)->start;
+    return (left > right) - (left < right);
+}
+
+int compare_references(const void* a, const void* b) {
+    const Reference* left = a;
+    const Reference* right = b;
+    if (left->declaration != right->declaration) return left->declaration - right->declaration;
+    return (left->offset > right->offset) - (left->offset < right->offset);
+}
+
+// Builds the lookup tables once resolution is done: every name occurrence
+// sorted by offset, and references grouped by the declaration they use.
+void finish_symbol_index(SymbolIndex* index) {
+    index->interval_count = 0;
+    for (int i = 0; i < index->declaration_count; i++) {
+        Declaration* declaration = &index->declarations[i];
+        write_interval(index, declaration->offset, declaration->length, i);
+    }
+    for (int i = 0; i < index->reference_count; i++) {
+        Reference* reference = &index->references[i];
+        write_interval(index, reference->offset, reference->length, reference->declaration);
+    }
+
+    qsort(index->intervals, index->interval_count, sizeof(Interval), compare_intervals);
+    qsort(index->references, index->reference_count, sizeof(Reference), compare_references);
+}
+
+// Returns the declaration whose name covers `offset`, or -1.
+int find_declaration_at(SymbolIndex* index, int64_t offset) {
+    int low = 0;
+    int high = index->interval_count - 1;
+    int found = -1;
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        if (index->intervals[mid].start <= offset) {
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    if (found == -1) return -1;
+    Interval* interval = &index->intervals[found];
+    return offset < interval->start + interval->length ? interval->declaration : -1;
+}
+
+// Returns the position of the first reference to `declaration`; the rest
+// follow it contiguously.
+int first_reference(SymbolIndex* index, int declaration) {
+    int low = 0;
+    int high = index->reference_count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (index->references[mid].declaration < declaration) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Scope functions
+
+Scope* new_scope(Scope* enclosing, FunctionState* function) {
+    Scope* scope = malloc(sizeof(Scope));
+    scope->enclosing = enclosing;
+    scope->function = function;
+    scope->index_scope = 0;
+    scope->table = NULL;
+    scope->table_capacity = 0;
+    init_variable_array(&scope->variables);
+    return scope;
+}
+
+void free_scope(Scope* scope) {
+    free_variable_array(&scope->variables);
+    free(scope->table);
+    free(scope);
+}
+
+// Scopes popped by end_scope are kept on a free list (linked through
+// `enclosing`) and handed out again together with their variable arrays.
+// `owner` is the block or function whose span the scope is indexed under.
+void begin_scope(Analyzer* analyzer, Stmt* owner) {
+    Scope* scope = analyzer->free_scopes;
+    if (scope != NULL) {
+        analyzer->free_scopes = scope->enclosing;
+        scope->enclosing = analyzer->current;
+        scope->function = analyzer->function;
+        scope->variables.count = 0;
+    } else {
+        scope = new_scope(analyzer->current, analyzer->function);
+    }
+    if (analyzer->index != NULL) {
+        scope->index_scope = record_scope(analyzer->index, owner->start, owner->end);
+    }
+    analyzer->current = scope;
+}
+
+void end_scope(Analyzer* analyzer) {
+    Scope* scope = analyzer->current;
+    analyzer->current = scope->enclosing;
+    scope->enclosing = analyzer->free_scopes;
+    analyzer->free_scopes = scope;
+}
+
+void init_analyzer(Analyzer* analyzer, Scope* globals, Arena* arena, Diagnostics* diagnostics) {
+    analyzer->current = globals;
+    analyzer->free_scopes = NULL;
+    analyzer->function = NULL;
+    analyzer->script_local_count = 0;
+    analyzer->arena = arena;
+    init_stmt_array(&analyzer->functions);
+    analyzer->index = NULL;
+    init_work_array(&analyzer->work);
+    analyzer->diagnostics = diagnostics;
+}
+
+// Puts the analyzer back at the start of a resolve. Scopes on the free list
+// and the work stack keep their memory.
+void reset_analyzer(Analyzer* analyzer, Scope* globals) {
+    analyzer->current = globals;
+    analyzer->function = NULL;
+    analyzer->script_local_count = 0;
+}
+
+void free_analyzer(Analyzer* analyzer) {
+    while (analyzer->free_scopes != NULL) {
+        Scope* scope = analyzer->free_scopes;
+        analyzer->free_scopes = scope->enclosing;
+        free_scope(scope);
+    }
+    free_stmt_array(&analyzer->functions);
+    free_work_array(&analyzer->work);
+}
+
+// Source location functions
+
+void init_source(Source* source, const char* text) {
+    source->text = text;
+    source->lines.starts = NULL;
+    source->lines.capacity = 0;
+    source->lines.count = 0;
+    source->lines_built = false;
+}
+
+void free_source(Source* source) {
+    free(source->lines.starts);
+    source->lines.starts = NULL;
+    source->lines.capacity = 0;
+    source->lines.count = 0;
+    source->lines_built = false;
+}
+
+void write_line_start(LineIndex* lines, int64_t offset) {
+    if (lines->capacity < lines->count + 1) {
+        int new_capacity = lines->capacity < 64 ? 64 : lines->capacity * 2;
+        lines->starts = realloc(lines->starts, new_capacity * sizeof(int64_t));
+        lines->capacity = new_capacity;
+    }
+    lines->starts[lines->count++] = offset;
+}
+
+// memchr is vectorized by libc, so this is a SIMD newline search without
+// any target-specific code here.
+void build_line_index(LineIndex* lines, const char* text) {
+    lines->count = 0;
+    write_line_start(lines, 0);
+
+    const char* end = text + strlen(text);
+    const char* cursor = text;
+    while (cursor < end) {
+        const char* newline = memchr(cursor, '\n', end - cursor);
+        if (newline == NULL) break;
+        write_line_start(lines, newline + 1 - text);
+        cursor = newline + 1;
+    }
+}
+
+// Lines and columns are 1-based. The line table is only built the first time
+// a location is asked for, so error-free compiles never scan for newlines.
+void source_location(Source* source, int64_t offset, int* line, int64_t* column) {
+    if (!source->lines_built) {
+        build_line_index(&source->lines, source->text);
+        source->lines_built = true;
+    }
+
+    int low = 0;
+    int high = source->lines.count - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (source->lines.starts[mid] <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    *line = low + 1;
+    *column = offset - source->lines.starts[low] + 1;
+}
+
+// Diagnostic functions
+
+const char* diagnostic_codes[] = {
+    [DIAG_SYNTAX] = "E0001",
+    [DIAG_UNEXPECTED_CHARACTER] = "E0002",
+    [DIAG_UNTERMINATED_STRING] = "E0003",
+    [DIAG_EXPECTED_EXPRESSION] = "E0004",
+    [DIAG_INVALID_ASSIGNMENT] = "E0005",
+    [DIAG_TOO_MANY_ARGUMENTS] = "E0006",
+    [DIAG_TOO_MANY_PARAMETERS] = "E0007",
+    [DIAG_DUPLICATE_DECLARATION] = "E0101",
+    [DIAG_SELF_INITIALIZER] = "E0102",
+};
+
+const char* severity_names[] = {
+    [SEVERITY_ERROR] = "error",
+    [SEVERITY_WARNING] = "warning",
+    [SEVERITY_NOTE] = "note",
+};
+
+void init_diagnostics(Diagnostics* diagnostics) {
+    diagnostics->items = NULL;
+    diagnostics->capacity = 0;
+    diagnostics->count = 0;
+    diagnostics->error_count = 0;
+}
+
+void free_diagnostics(Diagnostics* diagnostics) {
+    free(diagnostics->items);
+    init_diagnostics(diagnostics);
+}
+
+void write_diagnostic(Diagnostics* diagnostics, Diagnostic diagnostic) {
+    if (diagnostics->capacity < diagnostics->count + 1) {
+        int new_capacity = diagnostics->capacity < 8 ? 8 : diagnostics->capacity * 2;
+        diagnostics->items = realloc(diagnostics->items, new_capacity * sizeof(Diagnostic));
+        diagnostics->capacity = new_capacity;
+    }
+
+    diagnostics->items[diagnostics->count++] = diagnostic;
+    if (diagnostic.severity == SEVERITY_ERROR) diagnostics->error_count++;
+}
+
+void report(Diagnostics* diagnostics, Token* token, DiagnosticCode code, const char* message) {
+    Diagnostic diagnostic;
+    diagnostic.severity = SEVERITY_ERROR;
+    diagnostic.code = code;
+    diagnostic.offset = token->offset;
+    diagnostic.length = token->type == TOKEN_EOF || token->type == TOKEN_ERROR ? 0 : token->length;
+    diagnostic.start = token->start;
+    diagnostic.at_end = token->type == TOKEN_EOF;
+    diagnostic.message = message;
+    write_diagnostic(diagnostics, diagnostic);
+}
+
+void append_diagnostics(Diagnostics* diagnostics, Diagnostics* other) {
+    for (int i = 0; i < other->count; i++) {
+        write_diagnostic(diagnostics, other->items[i]);
+    }
+}
+
+int compare_diagnostics(const void* a, const void* b) {
+    const Diagnostic* left = a;
+    const Diagnostic* right = b;
+    if (left->offset != right->offset) return (left->offset > right->offset) - (left->offset < right->offset);
+    return (left->code > right->code) - (left->code < right->code);
+}
+
+void sort_diagnostics(Diagnostics* diagnostics, int first) {
+    // items is still NULL when nothing was reported, and qsort's base must
+    // not be NULL even for an empty range.
+    if (diagnostics->count - first < 2) return;
+    qsort(diagnostics->items + first, diagnostics->count - first, sizeof(Diagnostic), compare_diagnostics);
+}
+
+// Formats every diagnostic into one buffer and writes it with a single call.
+// Line numbers are only computed here, after compilation has finished.
+void render_diagnostics(Diagnostics* diagnostics, Source* source, FILE* out) {
+    if (diagnostics->count == 0) return;
+
+    size_t size = 0;
+    char* buffer = NULL;
+    FILE* stream = open_memstream(&buffer, &size);
+    if (stream == NULL) stream = out;
+
+    for (int i = 0; i < diagnostics->count; i++) {
+        Diagnostic* diagnostic = &diagnostics->items[i];
+        int line;
+        int64_t column;
+        source_location(source, diagnostic->offset, &line, &column);
+
+        fprintf(stream, "[line %d:%" PRId64 "] %s[%s]", line, column,
+                severity_names[diagnostic->severity], diagnostic_codes[diagnostic->code]);
+        if (diagnostic->at_end) {
+            fprintf(stream, " at end");
+        } else if (diagnostic->length > 0) {
+            fprintf(stream, " at '%.*s'", diagnostic->length, diagnostic->start);
+        }
+        fprintf(stream, ": %s\n", diagnostic->message);
+    }
+
+    if (stream != out) {
+        fclose(stream);
+        fwrite(buffer, 1, size, out);
+        free(buffer);
+    }
+}
+
+// Error handling functions
+
+void error_at(Parser* parser, Token* token, DiagnosticCode code, const char* message) {
+    if (parser->panic_mode) return;
+    parser->panic_mode = true;
+    parser->had_error = true;
+    report(parser->diagnostics, token, code, message);
+}
+
+void analyzer_error(Analyzer* analyzer, Token* token, DiagnosticCode code, const char* message) {
+    report(analyzer->diagnostics, token, code, message);
+}
+
+// Parallel helpers
+
+// `worker` is 0 on the calling thread and 1..worker_total()-1 on pool
+// threads, so tasks can index per-worker state without locking.
+typedef void (*ParallelTask)(void* context, int index, int worker);
+
+typedef struct {
+    ParallelTask task;
+    void* context;
+    int task_count;
+    int worker_limit;
+    atomic_int next;
+} ParallelJob;
+
+// Threads are started once and parked between jobs. A job is published by
+// bumping `generation`; each thread runs it and decrements `active`, and the
+// submitter waits on `done` until every thread has let go of the job.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    pthread_mutex_t submit;
+    pthread_t threads[MAX_WORKERS];
+    int thread_count;
+    unsigned generation;
+    int active;
+    ParallelJob* job;
+} WorkerPool;
+
+WorkerPool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .submit = PTHREAD_MUTEX_INITIALIZER,
+};
+pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+int worker_limit = MAX_WORKERS;
+
+void run_job(ParallelJob* job, int worker) {
+    if (worker >= job->worker_limit) return;
+    for (;;) {
+        int index = atomic_fetch_add(&job->next, 1);
+        if (index >= job->task_count) break;
+        job->task(job->context, index, worker);
+    }
+}
+
+void* pool_thread(void* arg) {
+    int worker = (int)(intptr_t)arg;
+    unsigned seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.generation == seen) pthread_cond_wait(&pool.wake, &pool.lock);
+        seen = pool.generation;
+        ParallelJob* job = pool.job;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_job(job, worker);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.active == 0) pthread_cond_signal(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+// One thread per online CPU, counting the caller; SPLANG_THREADS overrides.
+void start_pool(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* threads = getenv("SPLANG_THREADS");
+    if (threads != NULL && atoi(threads) > 0) cpus = atoi(threads);
+    if (cpus < 1) cpus = 1;
+    if (cpus > MAX_WORKERS) cpus = MAX_WORKERS;
+
+    for (int i = 1; i < cpus; i++) {
+        if (pthread_create(&pool.threads[pool.thread_count], NULL, pool_thread,
+                           (void*)(intptr_t)(pool.thread_count + 1)) != 0) break;
+        pool.thread_count++;
+    }
+}
+
+// Number of distinct `worker` values a task can see.
+int worker_total(void) {
+    pthread_once(&pool_once, start_pool);
+    return pool.thread_count + 1;
+}
+
+// Caps how many workers later jobs use, for scaling measurements.
+void set_worker_limit(int limit) {
+    worker_limit = limit < 1 ? 1 : limit;
+}
+
+int worker_count(int task_count) {
+    int workers = worker_total();
+    if (workers > worker_limit) workers = worker_limit;
+    return workers < task_count ? workers : task_count;
+}
+
+// Runs task(context, i, worker) for every i in [0, task_count) on the pool.
+// The calling thread takes part. A job submitted while another is running
+// (another context, or a task calling back in) runs inline on the caller.
+void run_parallel(int task_count, ParallelTask task, void* context) {
+    ParallelJob job;
+    job.task = task;
+    job.context = context;
+    job.task_count = task_count;
+    job.worker_limit = worker_count(task_count);
+    atomic_init(&job.next, 0);
+
+    if (job.worker_limit < 2 || pthread_mutex_trylock(&pool.submit) != 0) {
+        job.worker_limit = 1;
+        run_job(&job, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.job = &job;
+    pool.active = pool.thread_count;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_job(&job, 0);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.active > 0) pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.submit);
+}
+
+// Program resolution
+
+#define PARALLEL_RESOLVE_MIN_FUNCS 16
+
+typedef struct {
+    Stmt** funcs;
+    Worker* workers;
+} ResolveTasks;
+
+void resolve_function_task(void* context, int index, int worker) {
+    ResolveTasks* tasks = context;
+    resolve_function(tasks->funcs[index], &tasks->workers[worker].analyzer);
+}
+
+// Declares every top-level name up front, resolves the remaining top-level
+// statements in order, then resolves each function body as an independent
+// task against the now read-only global scope. Tasks allocate from and report
+// into their worker's state, which is merged in source order once all tasks
+// finish.
+void resolve_program(StmtArray* program, Analyzer* analyzer, Worker* workers) {
+    StmtArray* funcs = &analyzer->functions;
+    funcs->count = 0;
+
+    for (int i = 0; i < program->count; i++) {
+        Stmt* stmt = program->stmts[i];
+        if (stmt->type == STMT_FUNC) {
+            declare_function(analyzer, stmt);
+            write_stmt(funcs, stmt);
+        }
+    }
+
+    int first_diagnostic = analyzer->diagnostics->count;
+
+    for (int i = 0; i < program->count; i++) {
+        if (program->stmts[i]->type != STMT_FUNC) {
+            resolve_stmt(program->stmts[i], analyzer);
+        }
+    }
+
+    // Small modules resolve in place; the analyzer is already back at the
+    // global scope, which is exactly what each task would start from. The
+    // symbol index is shared state, so indexing also stays on this thread.
+    int func_count = funcs->count;
+    if (func_count < PARALLEL_RESOLVE_MIN_FUNCS || analyzer->index != NULL || workers == NULL) {
+        for (int i = 0; i < func_count; i++) {
+            resolve_function(funcs->stmts[i], analyzer);
+        }
+        sort_diagnostics(analyzer->diagnostics, first_diagnostic);
+        return;
+    }
+
+    ResolveTasks tasks;
+    tasks.funcs = funcs->stmts;
+    tasks.workers = workers;
+
+    int worker_total = worker_count(func_count);
+    for (int i = 0; i < worker_total; i++) {
+        workers[i].analyzer.current = analyzer->current;
+    }
+
+    run_parallel(func_count, resolve_function_task, &tasks);
+
+    for (int i = 0; i < worker_total; i++) {
+        append_diagnostics(analyzer->diagnostics, &workers[i].diagnostics);
+        workers[i].diagnostics.count = 0;
+        workers[i].diagnostics.error_count = 0;
+    }
+    sort_diagnostics(analyzer->diagnostics, first_diagnostic);
+}
+
+// Program parsing
+
+#define PARALLEL_PARSE_MIN_TOKENS 8192
+#define PARALLEL_PARSE_MIN_RANGE 1024
+
+typedef struct {
+    Token* tokens;
+    ParseRange* ranges;
+    Worker* workers;
+    int range_count;
+    int token_end;
+} ParseRanges;
+
+bool is_statement_end(TokenType type) {
+    return type == TOKEN_SEMICOLON || type == TOKEN_RIGHT_BRACE ||
+           type == TOKEN_NEWLINE || type == TOKEN_DEDENT;
+}
+
+bool parse_range(Arena* arena, StmtArray* scratch, ExprArray* operands, OperatorArray* operators,
+                 ParseFrameArray* frames, Diagnostics* diagnostics, Token* tokens, int start, int end,
+                 StmtArray* stmts) {
+    Parser parser;
+    init_parser(&parser, arena, scratch, operands, operators, frames, diagnostics, tokens, start, end);
+
+    while (parser.current.type != TOKEN_EOF) {
+        write_stmt(stmts, parse_declaration(&parser));
+    }
+
+    return !parser.had_error;
+}
+
+void parse_range_task(void* context, int index, int worker) {
+    ParseRanges* ranges = context;
+    ParseRange* range = &ranges->ranges[index];
+    Worker* state = &ranges->workers[worker];
+    int end = index + 1 < ranges->range_count ? ranges->ranges[index + 1].start : ranges->token_end;
+    range->had_error = !parse_range(&state->arena, &state->scratch, &state->operands, &state->operators,
+                                    &state->frames, &state->diagnostics, ranges->tokens, range->start, end,
+                                    &range->stmts);
+}
+
+// Cheap structural pass over the token buffer that splits it into at most
+// `max_ranges` spans of roughly equal token count. A span may only start at
+// a `func`/`var` that begins a statement at brace, paren and indent depth
+// zero. Returns the number of ranges whose start was written to `ranges`.
+int split_ranges(Token* tokens, int count, int max_ranges, int min_range, ParseRange* ranges) {
+    int target = count / max_ranges;
+    if (target < min_range) target = min_range;
+
+    int range_count = 0;
+    int depth = 0;
+    ranges[range_count++].start = 0;
+
+    for (int i = 0; i < count && range_count < max_ranges; i++) {
+        switch (tokens[i].type) {
+            case TOKEN_LEFT_BRACE:
+            case TOKEN_LEFT_PAREN:
+            case TOKEN_INDENT:
+                depth++;
+                break;
+            case TOKEN_RIGHT_BRACE:
+            case TOKEN_RIGHT_PAREN:
+            case TOKEN_DEDENT:
+                if (depth > 0) depth--;
+                break;
+            case TOKEN_FUNC:
+            case TOKEN_VAR:
+                if (depth == 0 && i > 0 && is_statement_end(tokens[i - 1].type) &&
+                    i - ranges[range_count - 1].start >= target) {
+                    ranges[range_count++].start = i;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    return range_count;
+}
+
+void scan_program(CompilerContext* context, Scanner* scanner) {
+    context->tokens.count = 0;
+    scan_all_tokens(scanner, &context->tokens);
+    intern_string_tokens(&context->strings, &context->tokens);
+}
+
+// Parses context->tokens into context->program, splitting buffers of at
+// least `min_tokens` into ranges of at least `min_range` tokens.
+bool parse_tokens(CompilerContext* context, int min_tokens, int min_range) {
+    TokenArray* tokens = &context->tokens;
+    StmtArray* program = &context->program;
+
+    // The EOF token stays out of every range; next_token synthesizes one.
+    int token_end = tokens->count - 1;
+    int max_ranges = worker_count(token_end / min_range + 1) * 4;
+    if (max_ranges > context->range_capacity) max_ranges = context->range_capacity;
+
+    if (token_end < min_tokens || max_ranges < 2) {
+        return parse_range(&context->arena, &context->scratch, &context->operands, &context->operators,
+                           &context->frames, &context->diagnostics, tokens->tokens, 0, tokens->count, program);
+    }
+
+    ParseRanges ranges;
+    ranges.tokens = tokens->tokens;
+    ranges.token_end = token_end;
+    ranges.ranges = context->ranges;
+    ranges.workers = context->workers;
+    ranges.range_count = split_ranges(tokens->tokens, token_end, max_ranges, min_range, ranges.ranges);
+    for (int i = 0; i < ranges.range_count; i++) {
+        ranges.ranges[i].stmts.count = 0;
+    }
+
+    run_parallel(ranges.range_count, parse_range_task, &ranges);
+
+    // Error-free ranges are in source order, so concatenating them reproduces
+    // the serial parse. After an error, recovery may skip across a range
+    // boundary (`{ 1 + } var x;` resumes at the `var`), so the ranges can no
+    // longer be trusted and the whole buffer is parsed again serially.
+    bool ok = true;
+    for (int i = 0; i < ranges.range_count; i++) {
+        if (ranges.ranges[i].had_error) ok = false;
+    }
+
+    if (ok) {
+        for (int i = 0; i < ranges.range_count; i++) {
+            StmtArray* stmts = &ranges.ranges[i].stmts;
+            for (int j = 0; j < stmts->count; j++) {
+                write_stmt(program, stmts->stmts[j]);
+            }
+        }
+    }
+
+    int first_diagnostic = context->diagnostics.count;
+    for (int i = 0; i < context->worker_count; i++) {
+        if (ok) append_diagnostics(&context->diagnostics, &context->workers[i].diagnostics);
+        context->workers[i].diagnostics.count = 0;
+        context->workers[i].diagnostics.error_count = 0;
+    }
+    sort_diagnostics(&context->diagnostics, first_diagnostic);
+
+    if (!ok) {
+        return parse_range(&context->arena, &context->scratch, &context->operands, &context->operators,
+                           &context->frames, &context->diagnostics, tokens->tokens, 0, tokens->count, program);
+    }
+    return true;
+}
+
+// Reachability
+
+void mark_function(WorkArray* work, Stmt* function) {
+    if (function == NULL || function->is_reachable) return;
+
+    function->is_reachable = true;
+    for (int i = 0; i < function->stmt_count; i++) {
+        write_work(work, WORK_STMT, function->body[i], NULL, NULL);
+    }
+}
+
+// Marks every function referenced from reachable code, starting from the
+// top-level statements. Any reference counts, not just calls, since a
+// function passed around as a value may still be called.
+void mark_reachable(StmtArray* program, WorkArray* work) {
+    int base = work->count;
+    for (int i = 0; i < program->count; i++) {
+        if (program->stmts[i]->type != STMT_FUNC) {
+            write_work(work, WORK_STMT, program->stmts[i], NULL, NULL);
+        }
+    }
+
+    while (work->count > base) {
+        WorkItem item = work->items[--work->count];
+
+        if (item.type == WORK_STMT) {
+            Stmt* stmt = item.stmt;
+            switch (stmt->type) {
+                case STMT_EXPR:
+                    write_work(work, WORK_EXPR, NULL, stmt->expr, NULL);
+                    break;
+                case STMT_VAR:
+                    if (stmt->var_decl.initializer != NULL) {
+                        write_work(work, WORK_EXPR, NULL, stmt->var_decl.initializer, NULL);
+                    }
+                    break;
+                case STMT_BLOCK:
+                    for (int i = 0; i < stmt->stmt_count; i++) {
+                        write_work(work, WORK_STMT, stmt->stmts[i], NULL, NULL);
+                    }
+                    break;
+                case STMT_IF:
+                    write_work(work, WORK_EXPR, NULL, stmt->expr, NULL);
+                    write_work(work, WORK_STMT, stmt->then_branch, NULL, NULL);
+                    if (stmt->else_branch != NULL) {
+                        write_work(work, WORK_STMT, stmt->else_branch, NULL, NULL);
+                    }
+                    break;
+                case STMT_WHILE:
+                    write_work(work, WORK_EXPR, NULL, stmt->expr, NULL);
+                    write_work(work, WORK_STMT, stmt->stmts[0], NULL, NULL);
+                    break;
+                case STMT_FUNC:
+                    // Nested functions are only walked once something refers to them.
+                    break;
+                case STMT_RETURN:
+                    if (stmt->expr != NULL) {
+                        write_work(work, WORK_EXPR, NULL, stmt->expr, NULL);
+                    }
+                    break;
+            }
+            continue;
+        }
+
+        Expr* expr = item.expr;
+        switch (expr->type) {
+            case EXPR_BINARY:
+            case EXPR_LOGICAL:
+                write_work(work, WORK_EXPR, NULL, expr->left, NULL);
+                write_work(work, WORK_EXPR, NULL, expr->right, NULL);
+                break;
+            case EXPR_UNARY:
+            case EXPR_ASSIGN:
+                write_work(work, WORK_EXPR, NULL, expr->right, NULL);
+                break;
+            case EXPR_GROUPING:
+                write_work(work, WORK_EXPR, NULL, expr->expr, NULL);
+                break;
+            case EXPR_VARIABLE:
+                mark_function(work, expr->variable.function);
+                break;
+            case EXPR_CALL:
+                write_work(work, WORK_EXPR, NULL, expr->callee, NULL);
+                for (int i = 0; i < expr->arg_count; i++) {
+                    write_work(work, WORK_EXPR, NULL, expr->args[i], NULL);
+                }
+                break;
+            case EXPR_LITERAL:
+                break;
+        }
+    }
+}
+
+// Drops unreachable function declarations from a statement list, counting
+// the functions seen and removed. Returns the new length. A dropped function
+// is still queued so the functions nested in it, which are unreachable too,
+// get counted.
+int sweep_stmts(Stmt** stmts, int count, StmtArray* pending, int* function_count, int* pruned_count) {
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        Stmt* stmt = stmts[i];
+        write_stmt(pending, stmt);
+        if (stmt->type == STMT_FUNC) {
+            (*function_count)++;
+            if (!stmt->is_reachable) {
+                (*pruned_count)++;
+                continue;
+            }
+        }
+
+        stmts[kept++] = stmt;
+    }
+    return kept;
+}
+
+// Removes functions that nothing reachable refers to, so later passes never
+// see them. Their nodes stay in the arena until the next compile resets it.
+// `pending` is borrowed as a stack and left as it was found.
+void prune_program(StmtArray* program, WorkArray* work, StmtArray* pending, int* function_count, int* pruned_count) {
+    *function_count = 0;
+    *pruned_count = 0;
+    mark_reachable(program, work);
+
+    int base = pending->count;
+    program->count = sweep_stmts(program->stmts, program->count, pending, function_count, pruned_count);
+
+    while (pending->count > base) {
+        Stmt* stmt = pending->stmts[--pending->count];
+        switch (stmt->type) {
+            case STMT_BLOCK:
+                stmt->stmt_count = sweep_stmts(stmt->stmts, stmt->stmt_count, pending, function_count, pruned_count);
+                break;
+            case STMT_FUNC:
+                stmt->stmt_count = sweep_stmts(stmt->body, stmt->stmt_count, pending, function_count, pruned_count);
+                break;
+            case STMT_IF:
+                write_stmt(pending, stmt->then_branch);
+                if (stmt->else_branch != NULL) write_stmt(pending, stmt->else_branch);
+                break;
+            case STMT_WHILE:
+                write_stmt(pending, stmt->stmts[0]);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// A pruned closure may have been the only thing capturing a variable or
+// adding an upvalue to its enclosing function. Walks the kept tree in the
+// resolver's order, clearing each declaration's capture flag and each
+// function's upvalues before anything below it can capture them again, and
+// replays every captured reference. The upvalue arrays are reused: pruning
+// only removes captures, so none of them has to grow.
+void recapture_program(StmtArray* program, WorkArray* work, Arena* arena) {
+    int base = work->count;
+    for (int i = program->count - 1; i >= 0; i--) {
+        write_work(work, WORK_STMT, program->stmts[i], NULL, NULL);
+    }
+
+    Stmt* function = NULL;
+    while (work->count > base) {
+        WorkItem item = work->items[--work->count];
+
+        if (item.type == WORK_END_FUNCTION) {
+            function = item.stmt->enclosing;
+            continue;
+        }
+
+        if (item.type == WORK_STMT) {
+            Stmt* stmt = item.stmt;
+            switch (stmt->type) {
+                case STMT_EXPR:
+                    write_work(work, WORK_EXPR, NULL, stmt->expr, NULL);
+                    break;
+                case STMT_VAR:
+                    stmt->var_decl.is_captured = false;
+                    if (stmt->var_decl.initializer != NULL) {
+                        write_work(work, WORK_EXPR, NULL, stmt->var_decl.initializer, NULL);
+                    }
+                    break;
+                case STMT_BLOCK:
+                    for (int i = stmt->stmt_count - 1; i >= 0; i--) {
+                        write_work(work, WORK_STMT, stmt->stmts[i], NULL, NULL);
+                    }
+                    break;
+                case STMT_IF:
+                    if (stmt->else_branch != NULL) {
+                        write_work(work, WORK_STMT, stmt->else_branch, NULL, NULL);
+                    }
+                    write_work(work, WORK_STMT, stmt->then_branch, NULL, NULL);
+                    write_work(work, WORK_EXPR, NULL, stmt->expr, NULL);
+                    break;
+                case STMT_WHILE:
+                    write_work(work, WORK_STMT, stmt->stmts[0], NULL, NULL);
+                    write_work(work, WORK_EXPR, NULL, stmt->expr, NULL);
+                    break;
+                case STMT_FUNC:
+                    stmt->is_captured = false;
+                    stmt->upvalue_count = 0;
+                    for (int i = 0; i < stmt->param_count; i++) {
+                        stmt->captured_params[i] = false;
+                    }
+                    function = stmt;
+                    write_work(work, WORK_END_FUNCTION, stmt, NULL, NULL);
+                    for (int i = stmt->stmt_count - 1; i >= 0; i--) {
+                        write_work(work, WORK_STMT, stmt->body[i], NULL, NULL);
+                    }
+                    break;
+                case STMT_RETURN:
+                    if (stmt->expr != NULL) {
+                        write_work(work, WORK_EXPR, NULL, stmt->expr, NULL);
+                    }
+                    break;
+            }
+            continue;
+        }
+
+        Expr* expr = item.expr;
+        if (item.type == WORK_EXPR) {
+            switch (expr->type) {
+                case EXPR_BINARY:
+                case EXPR_LOGICAL:
+                    write_work(work, WORK_EXPR, NULL, expr->right, NULL);
+                    write_work(work, WORK_EXPR, NULL, expr->left, NULL);
+                    continue;
+                case EXPR_UNARY:
+                    write_work(work, WORK_EXPR, NULL, expr->right, NULL);
+                    continue;
+                case EXPR_GROUPING:
+                    write_work(work, WORK_EXPR, NULL, expr->expr, NULL);
+                    continue;
+                case EXPR_ASSIGN:
+                    write_work(work, WORK_ASSIGN, NULL, expr, NULL);
+                    write_work(work, WORK_EXPR, NULL, expr->right, NULL);
+                    continue;
+                case EXPR_CALL:
+                    for (int i = expr->arg_count - 1; i >= 0; i--) {
+                        write_work(work, WORK_EXPR, NULL, expr->args[i], NULL);
+                    }
+                    write_work(work, WORK_EXPR, NULL, expr->callee, NULL);
+                    continue;
+                case EXPR_LITERAL:
+                    continue;
+                case EXPR_VARIABLE:
+                    break;
+            }
+        }
+
+        // A variable read, or the target of an assignment once its value is done.
+        if (expr->variable.is_captured) {
+            if (expr->variable.captured != NULL) *expr->variable.captured = true;
+            expr->variable.index = resolve_upvalue(arena, function, expr->variable.owner, &expr->token, expr->variable.slot);
+        }
+    }
+}
+
+// Type inference
+
+// TYPE_NONE means nothing has flowed in yet; two different types widen to
+// TYPE_UNKNOWN, so every slot can only move up and the fixed point terminates.
+ValueType join_types(ValueType a, ValueType b) {
+    if (a == TYPE_NONE) return b;
+    if (b == TYPE_NONE) return a;
+    return a == b ? a : TYPE_UNKNOWN;
+}
+
+// Widens a type cell and queues every unit that has read it.
+void merge_type(TypeChecker* checker, ValueType* target, ValueType type) {
+    ValueType joined = join_types(*target, type);
+    if (joined == *target) return;
+
+    *target = joined;
+    for (int i = first_reader(checker, target); i != -1; i = checker->readers[i].next) {
+        queue_unit(checker, checker->readers[i].unit);
+    }
+}
+
+ValueType literal_type(Token* token) {
+    switch (token->type) {
+        case TOKEN_NUMBER: return TYPE_NUMBER;
+        case TOKEN_STRING: return TYPE_STRING;
+        case TOKEN_TRUE:
+        case TOKEN_FALSE: return TYPE_BOOL;
+        case TOKEN_NIL: return TYPE_NIL;
+        default: return TYPE_UNKNOWN;
+    }
+}
+
+ValueType infer_binary(Expr* expr, ValueType left, ValueType right) {
+    if (left == TYPE_NONE || right == TYPE_NONE) return TYPE_NONE;
+
+    switch (expr->token.type) {
+        case TOKEN_PLUS:
+            if (left == TYPE_NUMBER && right == TYPE_NUMBER) return TYPE_NUMBER;
+            if (left == TYPE_STRING && right == TYPE_STRING) return TYPE_STRING;
+            return TYPE_UNKNOWN;
+        case TOKEN_MINUS:
+        case TOKEN_STAR:
+        case TOKEN_SLASH:
+        case TOKEN_POWER:
+            return left == TYPE_NUMBER && right == TYPE_NUMBER ? TYPE_NUMBER : TYPE_UNKNOWN;
+        case TOKEN_LESS:
+        case TOKEN_LESS_EQUAL:
+        case TOKEN_GREATER:
+        case TOKEN_GREATER_EQUAL:
+        case TOKEN_EQUAL_EQUAL:
+        case TOKEN_BANG_EQUAL:
+            return TYPE_BOOL;
+        default:
+            return TYPE_UNKNOWN;
+    }
+}
+
+// A call to a function name that is never reassigned always calls that
+// declaration, so it has the declaration's return type.
+ValueType infer_call(TypeChecker* checker, Expr* expr) {
+    if (expr->callee->type != EXPR_VARIABLE) return TYPE_UNKNOWN;
+
+    Expr* callee = expr->callee;
+    if (callee->variable.function == NULL) return TYPE_UNKNOWN;
+
+    read_cell(checker, callee->variable.type);
+    read_cell(checker, &callee->variable.function->return_type);
+    if (*callee->variable.type != TYPE_NONE) {
+        return TYPE_UNKNOWN;
+    }
+    return callee->variable.function->return_type;
+}
+
+// Infer array functions
+
+void init_infer_array(InferArray* array) {
+    array->items = NULL;
+    array->capacity = 0;
+    array->count = 0;
+}
+
+void free_infer_array(InferArray* array) {
+    free(array->items);
+    init_infer_array(array);
+}
+
+void write_infer(InferArray* array, InferStep step, Stmt* stmt, Expr* expr, Stmt* function) {
+    if (array->capacity < array->count + 1) {
+        int new_capacity = array->capacity < 8 ? 8 : array->capacity * 2;
+        array->items = realloc(array->items, new_capacity * sizeof(InferItem));
+        array->capacity = new_capacity;
+    }
+
+    InferItem* item = &array->items[array->count++];
+    item->step = step;
+    item->stmt = stmt;
+    item->expr = expr;
+    item->function = function;
+}
+
+void init_value_type_array(ValueTypeArray* array) {
+    array->types = NULL;
+    array->capacity = 0;
+    array->count = 0;
+}
+
+void free_value_type_array(ValueTypeArray* array) {
+    free(array->types);
+    init_value_type_array(array);
+}
+
+void write_value_type(ValueTypeArray* array, ValueType type) {
+    if (array->capacity < array->count + 1) {
+        int new_capacity = array->capacity < 8 ? 8 : array->capacity * 2;
+        array->types = realloc(array->types, new_capacity * sizeof(ValueType));
+        array->capacity = new_capacity;
+    }
+
+    array->types[array->count++] = type;
+}
+
+// Worklist functions
+
+void queue_unit(TypeChecker* checker, int index) {
+    if (checker->units[index].queued) return;
+
+    if (checker->queue_capacity < checker->queue_count + 1) {
+        int new_capacity = checker->queue_capacity < 8 ? 8 : checker->queue_capacity * 2;
+        checker->queue = realloc(checker->queue, new_capacity * sizeof(int));
+        checker->queue_capacity = new_capacity;
+    }
+
+    checker->units[index].queued = true;
+    checker->queue[checker->queue_count++] = index;
+}
+
+void add_unit(TypeChecker* checker, Stmt* function) {
+    if (checker->unit_capacity < checker->unit_count + 1) {
+        int new_capacity = checker->unit_capacity < 8 ? 8 : checker->unit_capacity * 2;
+        checker->units = realloc(checker->units, new_capacity * sizeof(InferUnit));
+        checker->unit_capacity = new_capacity;
+    }
+
+    InferUnit* unit = &checker->units[checker->unit_count];
+    unit->function = function;
+    unit->queued = false;
+    unit->seen = false;
+    unit->typed = 0;
+    unit->total = 0;
+    queue_unit(checker, checker->unit_count++);
+}
+
+uint32_t hash_cell(ValueType* cell) {
+    return (uint32_t)(((uintptr_t)cell >> 2) * 2654435761u);
+}
+
+// Returns the table slot for `cell`: the one holding its newest reader, or
+// the empty slot where it would go.
+uint32_t find_cell_slot(TypeChecker* checker, ValueType* cell) {
+    uint32_t mask = checker->reader_table_capacity - 1;
+    uint32_t slot = hash_cell(cell) & mask;
+    while (checker->reader_table[slot] != -1 && checker->readers[checker->reader_table[slot]].cell != cell) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void grow_reader_table(TypeChecker* checker) {
+    int old_capacity = checker->reader_table_capacity;
+    int* old_table = checker->reader_table;
+
+    int new_capacity = old_capacity < 16 ? 16 : old_capacity * 2;
+    checker->reader_table = malloc(new_capacity * sizeof(int));
+    checker->reader_table_capacity = new_capacity;
+    for (int i = 0; i < new_capacity; i++) checker->reader_table[i] = -1;
+
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_table[i] == -1) continue;
+        checker->reader_table[find_cell_slot(checker, checker->readers[old_table[i]].cell)] = old_table[i];
+    }
+    free(old_table);
+}
+
+int first_reader(TypeChecker* checker, ValueType* cell) {
+    if (checker->cell_count == 0) return -1;
+    return checker->reader_table[find_cell_slot(checker, cell)];
+}
+
+// Records that the running unit reads `cell`. Reads only depend on the
+// shape of the tree, so they are recorded on a unit's first run only. A unit
+// adds all of its readers during that one run, so a repeated read finds its
+// own entry at the head of the chain.
+void read_cell(TypeChecker* checker, ValueType* cell) {
+    if (checker->units[checker->unit].seen) return;
+    if ((checker->cell_count + 1) * 4 > checker->reader_table_capacity * 3) grow_reader_table(checker);
+
+    uint32_t slot = find_cell_slot(checker, cell);
+    int head = checker->reader_table[slot];
+    if (head != -1 && checker->readers[head].unit == checker->unit) return;
+    if (head == -1) checker->cell_count++;
+
+    if (checker->reader_capacity < checker->reader_count + 1) {
+        int new_capacity = checker->reader_capacity < 8 ? 8 : checker->reader_capacity * 2;
+        checker->readers = realloc(checker->readers, new_capacity * sizeof(CellReader));
+        checker->reader_capacity = new_capacity;
+    }
+
+    CellReader* reader = &checker->readers[checker->reader_count];
+    reader->cell = cell;
+    reader->unit = checker->unit;
+    reader->next = head;
+    checker->reader_table[slot] = checker->reader_count++;
+}
+
+// Type checker functions
+//
+// Like the resolver, inference walks the tree with an explicit stack so
+// nesting depth is bounded by memory rather than the C stack. Children are
+// pushed in reverse so they run in source order. An expression is entered,
+// its operands leave their types on checker->values, and its exit item pops
+// them and pushes its own; a statement's exit item consumes the value of
+// the expression it holds.
+
+void enter_stmt(TypeChecker* checker, Stmt* stmt, Stmt* function) {
+    InferArray* work = &checker->work;
+
+    switch (stmt->type) {
+        case STMT_EXPR:
+            write_infer(work, INFER_EXIT_STMT, stmt, NULL, function);
+            write_infer(work, INFER_EXPR, NULL, stmt->expr, function);
+            break;
+        case STMT_VAR:
+            write_infer(work, INFER_EXIT_STMT, stmt, NULL, function);
+            if (stmt->var_decl.initializer != NULL) {
+                write_infer(work, INFER_EXPR, NULL, stmt->var_decl.initializer, function);
+            }
+            break;
+        case STMT_BLOCK:
+            for (int i = stmt->stmt_count - 1; i >= 0; i--) {
+                write_infer(work, INFER_STMT, stmt->stmts[i], NULL, function);
+            }
+            break;
+        case STMT_IF:
+            if (stmt->else_branch != NULL) {
+                write_infer(work, INFER_STMT, stmt->else_branch, NULL, function);
+            }
+            write_infer(work, INFER_STMT, stmt->then_branch, NULL, function);
+            write_infer(work, INFER_EXIT_STMT, stmt, NULL, function);
+            write_infer(work, INFER_EXPR, NULL, stmt->expr, function);
+            break;
+        case STMT_WHILE:
+            write_infer(work, INFER_STMT, stmt->stmts[0], NULL, function);
+            write_infer(work, INFER_EXIT_STMT, stmt, NULL, function);
+            write_infer(work, INFER_EXPR, NULL, stmt->expr, function);
+            break;
+        case STMT_FUNC:
+            // The body is a unit of its own, found on the first run of the
+            // enclosing one.
+            if (!checker->units[checker->unit].seen) add_unit(checker, stmt);
+            break;
+        case STMT_RETURN:
+            write_infer(work, INFER_EXIT_STMT, stmt, NULL, function);
+            if (stmt->expr != NULL) {
+                write_infer(work, INFER_EXPR, NULL, stmt->expr, function);
+            }
+            break;
+    }
+}
+
+void exit_stmt(TypeChecker* checker, Stmt* stmt, Stmt* function) {
+    ValueTypeArray* values = &checker->values;
+
+    switch (stmt->type) {
+        case STMT_VAR: {
+            ValueType type = stmt->var_decl.initializer != NULL ? values->types[--values->count] : TYPE_NIL;
+            merge_type(checker, &stmt->var_decl.type, type);
+            break;
+        }
+        case STMT_RETURN: {
+            ValueType type = stmt->expr != NULL ? values->types[--values->count] : TYPE_NIL;
+            if (function != NULL) {
+                merge_type(checker, &function->return_type, type);
+            }
+            break;
+        }
+        default:
+            // The value of an expression statement or a condition.
+            values->count--;
+            break;
+    }
+}
+
+void enter_expr(TypeChecker* checker, Expr* expr, Stmt* function) {
+    InferArray* work = &checker->work;
+    write_infer(work, INFER_EXIT_EXPR, NULL, expr, function);
+
+    switch (expr->type) {
+        case EXPR_BINARY:
+        case EXPR_LOGICAL:
+            write_infer(work, INFER_EXPR, NULL, expr->right, function);
+            write_infer(work, INFER_EXPR, NULL, expr->left, function);
+            break;
+        case EXPR_UNARY:
+        case EXPR_ASSIGN:
+            write_infer(work, INFER_EXPR, NULL, expr->right, function);
+            break;
+        case EXPR_GROUPING:
+            write_infer(work, INFER_EXPR, NULL, expr->expr, function);
+            break;
+        case EXPR_CALL:
+            for (int i = expr->arg_count - 1; i >= 0; i--) {
+                write_infer(work, INFER_EXPR, NULL, expr->args[i], function);
+            }
+            write_infer(work, INFER_EXPR, NULL, expr->callee, function);
+            break;
+        case EXPR_LITERAL:
+        case EXPR_VARIABLE:
+            break;
+    }
+}
+
+void exit_expr(TypeChecker* checker, Expr* expr) {
+    ValueTypeArray* values = &checker->values;
+    ValueType type = TYPE_UNKNOWN;
+
+    switch (expr->type) {
+        case EXPR_LITERAL:
+            type = literal_type(&expr->token);
+            break;
+        case EXPR_GROUPING:
+            type = values->types[--values->count];
+            break;
+        case EXPR_UNARY: {
+            ValueType right = values->types[--values->count];
+            if (expr->token.type == TOKEN_BANG) type = TYPE_BOOL;
+            else if (right == TYPE_NUMBER || right == TYPE_NONE) type = right;
+            break;
+        }
+        case EXPR_BINARY: {
+            ValueType right = values->types[--values->count];
+            ValueType left = values->types[--values->count];
+            type = infer_binary(expr, left, right);
+            break;
+        }
+        case EXPR_LOGICAL: {
+            ValueType right = values->types[--values->count];
+            ValueType left = values->types[--values->count];
+            type = join_types(left, right);
+            break;
+        }
+        case EXPR_VARIABLE:
+            if (expr->variable.type != NULL && expr->variable.function == NULL) {
+                read_cell(checker, expr->variable.type);
+                type = *expr->variable.type;
+            }
+            break;
+        case EXPR_ASSIGN:
+            type = values->types[--values->count];
+            if (expr->variable.type != NULL) {
+                merge_type(checker, expr->variable.type, expr->variable.function != NULL ? TYPE_UNKNOWN : type);
+            }
+            break;
+        case EXPR_CALL:
+            values->count -= expr->arg_count + 1;
+            type = infer_call(checker, expr);
+            break;
+    }
+
+    // TYPE_NONE flows on so that a use seen before anything reaches its
+    // declaration doesn't widen what it feeds; it is only recorded as unknown.
+    expr->value_type = type == TYPE_NONE ? TYPE_UNKNOWN : type;
+    checker->total++;
+    if (expr->value_type != TYPE_UNKNOWN) checker->typed++;
+    write_value_type(values, type);
+}
+
+// Falling off the end of the body returns nil.
+void end_function(TypeChecker* checker, Stmt* stmt) {
+    if (stmt->stmt_count == 0 || stmt->body[stmt->stmt_count - 1]->type != STMT_RETURN) {
+        merge_type(checker, &stmt->return_type, TYPE_NIL);
+    }
+}
+
+// Runs one unit from start to end, recording which cells it reads the first
+// time, and keeps its counts from this run.
+void infer_unit(TypeChecker* checker, StmtArray* program, int index) {
+    InferArray* work = &checker->work;
+    Stmt* function = checker->units[index].function;
+    checker->unit = index;
+    checker->typed = 0;
+    checker->total = 0;
+
+    if (function == NULL) {
+        for (int i = program->count - 1; i >= 0; i--) {
+            write_infer(work, INFER_STMT, program->stmts[i], NULL, NULL);
+        }
+    } else {
+        write_infer(work, INFER_END_FUNCTION, function, NULL, NULL);
+        for (int i = function->stmt_count - 1; i >= 0; i--) {
+            write_infer(work, INFER_STMT, function->body[i], NULL, function);
+        }
+    }
+
+    while (work->count > 0) {
+        InferItem item = work->items[--work->count];
+
+        switch (item.step) {
+            case INFER_STMT:
+                enter_stmt(checker, item.stmt, item.function);
+                break;
+            case INFER_EXPR:
+                enter_expr(checker, item.expr, item.function);
+                break;
+            case INFER_EXIT_STMT:
+                exit_stmt(checker, item.stmt, item.function);
+                break;
+            case INFER_EXIT_EXPR:
+                exit_expr(checker, item.expr);
+                break;
+            case INFER_END_FUNCTION:
+                end_function(checker, item.stmt);
+                break;
+        }
+    }
+
+    InferUnit* unit = &checker->units[index];
+    unit->seen = true;
+    unit->typed = checker->typed;
+    unit->total = checker->total;
+}
+
+// Clears the type cells owned by each declaration: variables, function
+// bindings and return types. Parameters stay TYPE_UNKNOWN.
+void reset_types(TypeChecker* checker, StmtArray* program) {
+    InferArray* work = &checker->work;
+    for (int i = 0; i < program->count; i++) {
+        write_infer(work, INFER_STMT, program->stmts[i], NULL, NULL);
+    }
+
+    while (work->count > 0) {
+        Stmt* stmt = work->items[--work->count].stmt;
+        switch (stmt->type) {
+            case STMT_VAR:
+                stmt->var_decl.type = TYPE_NONE;
+                break;
+            case STMT_BLOCK:
+                for (int i = 0; i < stmt->stmt_count; i++) {
+                    write_infer(work, INFER_STMT, stmt->stmts[i], NULL, NULL);
+                }
+                break;
+            case STMT_IF:
+                write_infer(work, INFER_STMT, stmt->then_branch, NULL, NULL);
+                if (stmt->else_branch != NULL) {
+                    write_infer(work, INFER_STMT, stmt->else_branch, NULL, NULL);
+                }
+                break;
+            case STMT_WHILE:
+                write_infer(work, INFER_STMT, stmt->stmts[0], NULL, NULL);
+                break;
+            case STMT_FUNC:
+                stmt->return_type = TYPE_NONE;
+                stmt->binding_type = TYPE_NONE;
+                for (int i = 0; i < stmt->stmt_count; i++) {
+                    write_infer(work, INFER_STMT, stmt->body[i], NULL, NULL);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void init_type_checker(TypeChecker* checker) {
+    checker->unit = 0;
+    checker->typed = 0;
+    checker->total = 0;
+    init_infer_array(&checker->work);
+    init_value_type_array(&checker->values);
+    checker->units = NULL;
+    checker->unit_capacity = 0;
+    checker->unit_count = 0;
+    checker->queue = NULL;
+    checker->queue_capacity = 0;
+    checker->queue_count = 0;
+    checker->readers = NULL;
+    checker->reader_capacity = 0;
+    checker->reader_count = 0;
+    checker->reader_table = NULL;
+    checker->reader_table_capacity = 0;
+    checker->cell_count = 0;
+}
+
+void free_type_checker(TypeChecker* checker) {
+    free_infer_array(&checker->work);
+    free_value_type_array(&checker->values);
+    free(checker->units);
+    free(checker->queue);
+    free(checker->readers);
+    free(checker->reader_table);
+    init_type_checker(checker);
+}
+
+void reset_type_checker(TypeChecker* checker) {
+    checker->work.count = 0;
+    checker->values.count = 0;
+    checker->unit_count = 0;
+    checker->queue_count = 0;
+    checker->reader_count = 0;
+    checker->cell_count = 0;
+    for (int i = 0; i < checker->reader_table_capacity; i++) checker->reader_table[i] = -1;
+}
+
+// Annotates every expression with its static type. Each declaration owns a
+// type cell that the resolver linked to every use of it, and cells and
+// function return types only ever widen. Every unit runs once; after that a
+// unit runs again only when a cell it read has widened, so assignments later
+// in a loop or calls before a function's body are accounted for without
+// re-walking the whole program. Each unit's counts from its last run are
+// summed into typed/total.
+void infer_types(TypeChecker* checker, StmtArray* program, int* typed, int* total) {
+    reset_type_checker(checker);
+    reset_types(checker, program);
+
+    add_unit(checker, NULL);
+    while (checker->queue_count > 0) {
+        int index = checker->queue[--checker->queue_count];
+        checker->units[index].queued = false;
+        infer_unit(checker, program, index);
+    }
+
+    *typed = 0;
+    *total = 0;
+    for (int i = 0; i < checker->unit_count; i++) {
+        *typed += checker->units[i].typed;
+        *total += checker->units[i].total;
+    }
+}
+
+// Compiler context
+
+void init_compiler_context(CompilerContext* context) {
+    init_arena(&context->arena);
+    init_source(&context->source, "");
+    init_token_array(&context->tokens);
+    init_stmt_array(&context->scratch);
+    init_expr_array(&context->operands);
+    init_operator_array(&context->operators);
+    init_parse_frame_array(&context->frames);
+    init_stmt_array(&context->program);
+    init_string_pool(&context->strings, &context->arena);
+    init_diagnostics(&context->diagnostics);
+    init_variable_array(&context->globals.variables);
+    context->globals.enclosing = NULL;
+    context->globals.function = NULL;
+    context->globals.index_scope = 0;
+    context->globals.table = NULL;
+    context->globals.table_capacity = 0;
+    init_analyzer(&context->analyzer, &context->globals, &context->arena, &context->diagnostics);
+
+    context->worker_count = worker_total();
+    context->workers = malloc(context->worker_count * sizeof(Worker));
+    for (int i = 0; i < context->worker_count; i++) {
+        Worker* worker = &context->workers[i];
+        init_arena(&worker->arena);
+        init_stmt_array(&worker->scratch);
+        init_expr_array(&worker->operands);
+        init_operator_array(&worker->operators);
+        init_parse_frame_array(&worker->frames);
+        init_diagnostics(&worker->diagnostics);
+        init_analyzer(&worker->analyzer, &context->globals, &worker->arena, &worker->diagnostics);
+    }
+
+    context->range_capacity = context->worker_count * 4;
+    context->ranges = malloc(context->range_capacity * sizeof(ParseRange));
+    for (int i = 0; i < context->range_capacity; i++) {
+        init_stmt_array(&context->ranges[i].stmts);
+    }
+
+    init_type_checker(&context->types);
+    context->typed_count = 0;
+    context->expr_count = 0;
+    context->function_count = 0;
+    context->pruned_count = 0;
+}
+
+void reset_compiler_context(CompilerContext* context) {
+    reset_arena(&context->arena);
+    context->source.lines_built = false;
+    context->tokens.count = 0;
+    context->scratch.count = 0;
+    context->operands.count = 0;
+    context->operators.count = 0;
+    context->frames.count = 0;
+    context->program.count = 0;
+    reset_string_pool(&context->strings);
+    context->diagnostics.count = 0;
+    context->diagnostics.error_count = 0;
+    clear_global_scope(&context->globals);
+    reset_analyzer(&context->analyzer, &context->globals);
+    for (int i = 0; i < context->worker_count; i++) {
+        Worker* worker = &context->workers[i];
+        reset_arena(&worker->arena);
+        worker->scratch.count = 0;
+        worker->operands.count = 0;
+        worker->operators.count = 0;
+        worker->frames.count = 0;
+        worker->diagnostics.count = 0;
+        worker->diagnostics.error_count = 0;
+        reset_analyzer(&worker->analyzer, &context->globals);
+    }
+    context->typed_count = 0;
+    context->expr_count = 0;
+    context->function_count = 0;
+    context->pruned_count = 0;
+}
+
+void free_compiler_context(CompilerContext* context) {
+    free_type_checker(&context->types);
+    for (int i = 0; i < context->range_capacity; i++) {
+        free_stmt_array(&context->ranges[i].stmts);
+    }
+    free(context->ranges);
+    for (int i = 0; i < context->worker_count; i++) {
+        Worker* worker = &context->workers[i];
+        free_analyzer(&worker->analyzer);
+        free_diagnostics(&worker->diagnostics);
+        free_parse_frame_array(&worker->frames);
+        free_stmt_array(&worker->scratch);
+        free_expr_array(&worker->operands);
+        free_operator_array(&worker->operators);
+        free_arena(&worker->arena);
+    }
+    free(context->workers);
+    free_analyzer(&context->analyzer);
+    free_variable_array(&context->globals.variables);
+    free(context->globals.table);
+    free_diagnostics(&context->diagnostics);
+    free_string_pool(&context->strings);
+    free_stmt_array(&context->program);
+    free_parse_frame_array(&context->frames);
+    free_stmt_array(&context->scratch);
+    free_expr_array(&context->operands);
+    free_operator_array(&context->operators);
+    free_token_array(&context->tokens);
+    free_source(&context->source);
+    free_arena(&context->arena);
+}
+
+// Parses, resolves and type-checks the tokens in context->tokens. A symbol
+// index still gets everything the parser recovered after a syntax error, so
+// a half-typed edit does not blank out the rest of the file.
+bool compile_tokens(CompilerContext* context) {
+    bool parsed = parse_tokens(context, PARALLEL_PARSE_MIN_TOKENS, PARALLEL_PARSE_MIN_RANGE);
+    if (!parsed && context->analyzer.index == NULL) return false;
+
+    resolve_program(&context->program, &context->analyzer, context->workers);
+    if (!parsed || context->diagnostics.error_count > 0) return false;
+
+    prune_program(&context->program, &context->analyzer.work, &context->scratch,
+                  &context->function_count, &context->pruned_count);
+    if (context->pruned_count > 0) recapture_program(&context->program, &context->analyzer.work, &context->arena);
+    infer_types(&context->types, &context->program, &context->typed_count, &context->expr_count);
+    return true;
+}
+
+// Parses, resolves and type-checks `source`, which must outlive the results.
+// The AST is left in context->program and problems in context->diagnostics;
+// both stay valid until the next compile or reset.
+bool compile(CompilerContext* context, const char* source) {
+    reset_compiler_context(context);
+    context->source.text = source;
+
+    Scanner scanner;
+    init_scanner(&scanner, source);
+    scan_program(context, &scanner);
+    return compile_tokens(context);
+}
+
+// Copies the lexeme out of the stream's ring into the context arena, so the
+// token stays valid after the chunk it was read from is reused.
+void stream_token(Token* token, void* context) {
+    CompilerContext* compiler = context;
+    Token copy = *token;
+    if (token->type != TOKEN_ERROR && token->length > 0) {
+        char* lexeme = arena_alloc(&compiler->arena, token->length);
+        memcpy(lexeme, token->start, token->length);
+        copy.start = lexeme;
+    }
+    write_token(&compiler->tokens, copy);
+}
+
+// Reads the program from `input` in fixed-size chunks instead of one
+// contiguous buffer. Only tokens are kept: trivia is dropped as it is read
+// and the line table is built on the way, so there is no source text.
+void scan_stream_program(CompilerContext* context, FILE* input, int chunk_size) {
+    context->tokens.count = 0;
+    scan_stream(input, chunk_size, &context->source.lines, stream_token, context);
+    context->source.lines_built = true;
+    intern_string_tokens(&context->strings, &context->tokens);
+}
+
+// Like compile, but reads the program from `input`; lexemes live in the
+// context arena until the next compile or reset.
+bool compile_stream(CompilerContext* context, FILE* input) {
+    reset_compiler_context(context);
+    context->source.text = NULL;
+    scan_stream_program(context, input, STREAM_CHUNK_SIZE);
+    return compile_tokens(context);
+}
@@ -0,0 +1,595 @@
+#ifndef SPLANG_H
+#define SPLANG_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Token types and scanner code
+typedef enum {
+  TOKEN_VAR,
+  TOKEN_SEMICOLON,
+  TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+  TOKEN_PLUS, TOKEN_MINUS, TOKEN_STAR, TOKEN_SLASH,
+  TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
+  TOKEN_BANG, TOKEN_BANG_EQUAL,
+  TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
+  TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE, TOKEN_FOR, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
+  TOKEN_POWER, TOKEN_EOF, TOKEN_INDENT, TOKEN_DEDENT, TOKEN_NEWLINE,
+  TOKEN_LET, TOKEN_FUNC, TOKEN_RETURN, TOKEN_WHILE, TOKEN_TRUE,
+  TOKEN_LESS, TOKEN_LESS_EQUAL, TOKEN_GREATER, TOKEN_GREATER_EQUAL,
+  TOKEN_COMMA, TOKEN_DOT, TOKEN_COLON,
+  TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
+  TOKEN_ERROR,
+} TokenType;
+
+typedef enum {
+    SEVERITY_ERROR,
+    SEVERITY_WARNING,
+    SEVERITY_NOTE
+} Severity;
+
+typedef enum {
+    DIAG_SYNTAX,
+    DIAG_UNEXPECTED_CHARACTER,
+    DIAG_UNTERMINATED_STRING,
+    DIAG_EXPECTED_EXPRESSION,
+    DIAG_INVALID_ASSIGNMENT,
+    DIAG_TOO_MANY_ARGUMENTS,
+    DIAG_TOO_MANY_PARAMETERS,
+    DIAG_DUPLICATE_DECLARATION,
+    DIAG_SELF_INITIALIZER
+} DiagnosticCode;
+
+typedef struct {
+    TokenType type;
+    const char* start;
+    int length;
+    int64_t offset;
+    int string_index;
+    DiagnosticCode error_code;
+} Token;
+
+typedef struct {
+    Token* tokens;
+    int capacity;
+    int count;
+} TokenArray;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t capacity;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* first;
+    ArenaBlock* current;
+} Arena;
+
+typedef struct {
+    const char* source;
+    const char* start;
+    const char* current;
+    int64_t base;
+} Scanner;
+
+typedef struct {
+    int64_t* starts;
+    int capacity;
+    int count;
+} LineIndex;
+
+typedef struct {
+    const char* text;
+    LineIndex lines;
+    bool lines_built;
+} Source;
+
+typedef struct {
+    Severity severity;
+    DiagnosticCode code;
+    int64_t offset;
+    int length;
+    const char* start;
+    bool at_end;
+    const char* message;
+} Diagnostic;
+
+typedef struct {
+    Diagnostic* items;
+    int capacity;
+    int count;
+    int error_count;
+} Diagnostics;
+
+#define STREAM_CHUNK_SIZE 65536
+#define STREAM_RING_SIZE 4
+#define MAX_WORKERS 64
+
+typedef struct {
+    char* data;
+    int capacity;
+} StreamBuffer;
+
+typedef struct {
+    FILE* input;
+    StreamBuffer ring[STREAM_RING_SIZE];
+    int active;
+    int chunk_size;
+    const char* data_end;
+    bool at_eof;
+    bool in_comment;
+    LineIndex* lines;
+    Scanner scanner;
+} StreamScanner;
+
+typedef void (*TokenSink)(Token* token, void* context);
+
+typedef struct {
+    const char* start;
+    int length;
+    uint32_t hash;
+    bool has_escapes;
+    char* decoded;
+    int decoded_length;
+} StringLiteral;
+
+typedef struct {
+    StringLiteral* literals;
+    int capacity;
+    int count;
+    int* table;
+    int table_capacity;
+    Arena* arena;
+    pthread_mutex_t lock;
+} StringPool;
+
+typedef enum {
+    TYPE_NONE,
+    TYPE_NUMBER,
+    TYPE_BOOL,
+    TYPE_STRING,
+    TYPE_NIL,
+    TYPE_UNKNOWN
+} ValueType;
+
+typedef enum {
+    EXPR_BINARY,
+    EXPR_UNARY,
+    EXPR_LITERAL,
+    EXPR_GROUPING,
+    EXPR_VARIABLE,
+    EXPR_ASSIGN,
+    EXPR_LOGICAL,
+    EXPR_CALL
+} ExprType;
+
+typedef struct Expr {
+    ExprType type;
+    Token token;
+    struct Expr* left;
+    struct Expr* right;
+    struct Expr* expr;
+    struct Expr* callee;
+    double value;
+    int string_index;
+    const char* name;
+    int arg_count;
+    struct Expr** args;
+    ValueType value_type;
+    struct {
+        int depth;
+        int index;
+        // Where the variable lives, so captures can be rebuilt without
+        // resolving the names again.
+        int slot;
+        bool is_captured;
+        struct Stmt* function;
+        ValueType* type;
+        struct Stmt* owner;
+        bool* captured;
+    } variable;
+} Expr;
+
+typedef struct {
+    Token name;
+    Expr* initializer;
+    bool is_captured;
+    ValueType type;
+} VarDecl;
+
+typedef struct {
+    Token name;
+    int index;
+    bool is_local;
+} Upvalue;
+
+typedef enum {
+    STMT_EXPR,
+    STMT_VAR,
+    STMT_BLOCK,
+    STMT_IF,
+    STMT_WHILE,
+    STMT_FUNC,
+    STMT_RETURN
+} StmtType;
+
+typedef struct Stmt {
+    StmtType type;
+    Expr* expr;
+    VarDecl var_decl;
+    struct Stmt** stmts;
+    int stmt_count;
+    struct Stmt* then_branch;
+    struct Stmt* else_branch;
+    Token name;
+    struct Stmt** body;
+    int param_count;
+    Token* params;
+    bool is_captured;
+    bool* captured_params;
+    ValueType* param_types;
+    ValueType binding_type;
+    Upvalue* upvalues;
+    int upvalue_count;
+    int upvalue_capacity;
+    // The function this one is declared in, or NULL at the top level.
+    struct Stmt* enclosing;
+    ValueType return_type;
+    bool is_reachable;
+    // Source span of the scope a block or function opens.
+    int64_t start;
+    int64_t end;
+} Stmt;
+
+typedef struct {
+    Stmt** stmts;
+    int capacity;
+    int count;
+} StmtArray;
+
+typedef struct {
+    Expr** exprs;
+    int capacity;
+    int count;
+} ExprArray;
+
+typedef enum {
+    FRAME_BLOCK,
+    FRAME_FUNC,
+    FRAME_IF,
+    FRAME_WHILE
+} ParseFrameType;
+
+// A statement whose header has been parsed and which is waiting for its
+// nested statements.
+typedef struct {
+    ParseFrameType type;
+    Stmt* stmt;
+    int base;
+    bool declaration;
+    int64_t start;
+} ParseFrame;
+
+typedef struct {
+    ParseFrame* frames;
+    int capacity;
+    int count;
+} ParseFrameArray;
+
+// How tightly an infix operator binds. Prefix operators bind at PREC_UNARY
+// and calls tighter than anything listed.
+typedef enum {
+    PREC_NONE,
+    PREC_ASSIGNMENT,
+    PREC_OR,
+    PREC_AND,
+    PREC_EQUALITY,
+    PREC_COMPARISON,
+    PREC_TERM,
+    PREC_FACTOR,
+    PREC_UNARY
+} Precedence;
+
+typedef enum {
+    OPERATOR_PREFIX,
+    OPERATOR_INFIX,
+    OPERATOR_ASSIGN,
+    OPERATOR_GROUP,
+    OPERATOR_CALL
+} OperatorType;
+
+// An operator waiting for its right operand, or the open '(' of a grouping
+// or call. `base` is where a call's callee sits on the operand stack.
+typedef struct {
+    OperatorType type;
+    Token token;
+    Precedence precedence;
+    int base;
+} Operator;
+
+typedef struct {
+    Operator* operators;
+    int capacity;
+    int count;
+} OperatorArray;
+
+typedef struct {
+    Token current;
+    Token previous;
+    Token* tokens;
+    int position;
+    int end;
+    Arena* arena;
+    StmtArray* scratch;
+    ExprArray* operands;
+    OperatorArray* operators;
+    Diagnostics* diagnostics;
+    bool had_error;
+    bool panic_mode;
+    ParseFrameArray* frames;
+} Parser;
+
+typedef struct {
+    const char* name;
+    int length;
+    // -1 from declaration until its initializer has been resolved.
+    int depth;
+    int slot;
+    bool is_const;
+    bool* captured;
+    ValueType* type;
+    int declaration;
+    Stmt* function;
+} Variable;
+
+typedef struct {
+    Variable* variables;
+    int capacity;
+    int count;
+} VariableArray;
+
+typedef struct FunctionState {
+    struct FunctionState* enclosing;
+    Stmt* decl;
+    int local_count;
+} FunctionState;
+
+typedef struct Scope {
+    VariableArray variables;
+    struct Scope* enclosing;
+    FunctionState* function;
+    int index_scope;
+    // Only the global scope is hashed: it holds every top-level name of a
+    // module, while block scopes stay small enough to scan.
+    int* table;
+    int table_capacity;
+} Scope;
+
+typedef enum {
+    SYMBOL_VARIABLE,
+    SYMBOL_FUNCTION,
+    SYMBOL_PARAMETER
+} SymbolKind;
+
+typedef struct {
+    SymbolKind kind;
+    int64_t offset;
+    int length;
+    int scope;
+} Declaration;
+
+typedef struct {
+    int64_t offset;
+    int length;
+    int declaration;
+} Reference;
+
+typedef struct {
+    int64_t start;
+    int64_t end;
+} ScopeRange;
+
+typedef struct {
+    int64_t start;
+    int length;
+    int declaration;
+} Interval;
+
+typedef struct {
+    Declaration* declarations;
+    int declaration_capacity;
+    int declaration_count;
+    Reference* references;
+    int reference_capacity;
+    int reference_count;
+    ScopeRange* scopes;
+    int scope_capacity;
+    int scope_count;
+    Interval* intervals;
+    int interval_capacity;
+    int interval_count;
+} SymbolIndex;
+
+typedef enum {
+    WORK_STMT,
+    WORK_EXPR,
+    WORK_DEFINE,
+    WORK_ASSIGN,
+    WORK_END_SCOPE,
+    WORK_END_FUNCTION
+} WorkType;
+
+typedef struct {
+    WorkType type;
+    Stmt* stmt;
+    Expr* expr;
+    FunctionState* function;
+} WorkItem;
+
+typedef struct {
+    WorkItem* items;
+    int capacity;
+    int count;
+} WorkArray;
+
+typedef struct {
+    Scope* current;
+    Scope* free_scopes;
+    FunctionState* function;
+    int script_local_count;
+    Arena* arena;
+    StmtArray functions;
+    SymbolIndex* index;
+    WorkArray work;
+    Diagnostics* diagnostics;
+} Analyzer;
+
+// What one pool worker needs to parse ranges or resolve functions for a
+// context. Tasks index it by their `worker` argument; like the context, it
+// is reset rather than freed between compiles.
+typedef struct {
+    Arena arena;
+    StmtArray scratch;
+    ExprArray operands;
+    OperatorArray operators;
+    ParseFrameArray frames;
+    Diagnostics diagnostics;
+    Analyzer analyzer;
+} Worker;
+
+// One span of top-level statements parsed as a single task.
+typedef struct {
+    int start;
+    bool had_error;
+    StmtArray stmts;
+} ParseRange;
+
+typedef enum {
+    INFER_STMT,
+    INFER_EXPR,
+    INFER_EXIT_STMT,
+    INFER_EXIT_EXPR,
+    INFER_END_FUNCTION
+} InferStep;
+
+// `function` is the function whose body the statement is in, or NULL at
+// the top level.
+typedef struct {
+    InferStep step;
+    Stmt* stmt;
+    Expr* expr;
+    Stmt* function;
+} InferItem;
+
+typedef struct {
+    InferItem* items;
+    int capacity;
+    int count;
+} InferArray;
+
+typedef struct {
+    ValueType* types;
+    int capacity;
+    int count;
+} ValueTypeArray;
+
+// A body that inference runs as a whole: the top-level code (`function`
+// NULL) or one function's body. Nested functions are units of their own.
+typedef struct {
+    Stmt* function;
+    bool queued;
+    bool seen;
+    int typed;
+    int total;
+} InferUnit;
+
+// A unit that reads a type cell. Readers of one cell are chained through
+// `next`, newest first.
+typedef struct {
+    ValueType* cell;
+    int unit;
+    int next;
+} CellReader;
+
+typedef struct {
+    int unit;
+    int typed;
+    int total;
+    InferArray work;
+    ValueTypeArray values;
+    InferUnit* units;
+    int unit_capacity;
+    int unit_count;
+    int* queue;
+    int queue_capacity;
+    int queue_count;
+    CellReader* readers;
+    int reader_capacity;
+    int reader_count;
+    // Maps a cell to its newest reader.
+    int* reader_table;
+    int reader_table_capacity;
+    int cell_count;
+} TypeChecker;
+
+// Owns every buffer a compile needs. Resetting keeps the memory, so once the
+// buffers have grown to fit, compiling another snippet allocates nothing.
+// Contexts share no state; use one per thread. A context must not be moved
+// after init_compiler_context, since its members point at each other.
+typedef struct {
+    Arena arena;
+    Source source;
+    TokenArray tokens;
+    StmtArray scratch;
+    ExprArray operands;
+    OperatorArray operators;
+    ParseFrameArray frames;
+    StmtArray program;
+    StringPool strings;
+    Diagnostics diagnostics;
+    Scope globals;
+    Analyzer analyzer;
+    Worker* workers;
+    int worker_count;
+    ParseRange* ranges;
+    int range_capacity;
+    TypeChecker types;
+    int typed_count;
+    int expr_count;
+    int function_count;
+    int pruned_count;
+} CompilerContext;
+
+// Library interface
+
+void init_scanner(Scanner* scanner, const char* source);
+const char* string_literal_text(StringPool* pool, int index, int* length);
+
+void init_symbol_index(SymbolIndex* index);
+void free_symbol_index(SymbolIndex* index);
+void reset_symbol_index(SymbolIndex* index);
+void finish_symbol_index(SymbolIndex* index);
+int find_declaration_at(SymbolIndex* index, int64_t offset);
+int first_reference(SymbolIndex* index, int declaration);
+
+void source_location(Source* source, int64_t offset, int* line, int64_t* column);
+void render_diagnostics(Diagnostics* diagnostics, Source* source, FILE* out);
+
+int worker_total(void);
+void set_worker_limit(int limit);
+
+void scan_program(CompilerContext* context, Scanner* scanner);
+void scan_stream_program(CompilerContext* context, FILE* input, int chunk_size);
+bool parse_tokens(CompilerContext* context, int min_tokens, int min_range);
+
+void init_compiler_context(CompilerContext* context);
+void reset_compiler_context(CompilerContext* context);
+void free_compiler_context(CompilerContext* context);
+bool compile(CompilerContext* context, const char* source);
+bool compile_stream(CompilerContext* context, FILE* input);
+
+#endif